@@ -3,10 +3,15 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <math.h>
+#include <limits.h>
 
 #include "lzp_core.h"
 #include "mpc.h"
+#ifdef LZP_PRELUDE_TEXT
 #include "prelude.h"
+#else
+#include "prelude_image.h"
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -35,328 +40,722 @@ void add_history(char* unused) {}
 #include <editline/history.h>
 #endif
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM && a->cell[i]->type != LVAL_FLT) {
-            lval_del(a);
-            return lval_err("Cannot operate on non-number!");
-        }
+/*
+ * Operators shared by one builtin body, picked once per call rather than
+ * compared by name for every operand.
+ */
+enum lop {
+    LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD, LOP_POW, LOP_MIN, LOP_MAX,
+    LOP_GT, LOP_LT, LOP_GE, LOP_LE,
+    LOP_EQ, LOP_NE,
+    LOP_NOT, LOP_OR, LOP_AND
+};
+
+static char* lop_names[] = {
+    "+", "-", "*", "/", "%", "**", "min", "max",
+    ">", "<", ">=", "<=",
+    "==", "!=",
+    "!", "||", "&&"
+};
+
+/*
+ * Arithmetic kernels, one for each operator and operand type, updating
+ * the accumulator x in place. They return an error, or NULL. Integer
+ * kernels fail on overflow instead of wrapping around.
+ */
+typedef lval* (*lnum_kernel)(long long* x, long long y);
+typedef lval* (*lflt_kernel)(double* x, double y);
+
+static lval* lop_overflow(void) {
+    return lval_err("Integer overflow!");
+}
 
+static lval* lnum_add(long long* x, long long y) {
+    return __builtin_add_overflow(*x, y, x) ? lop_overflow() : NULL;
+}
+
+static lval* lnum_sub(long long* x, long long y) {
+    return __builtin_sub_overflow(*x, y, x) ? lop_overflow() : NULL;
+}
+
+static lval* lnum_mul(long long* x, long long y) {
+    return __builtin_mul_overflow(*x, y, x) ? lop_overflow() : NULL;
+}
+
+static lval* lnum_div(long long* x, long long y) {
+    if (y == 0) {
+        return lval_err("Division by Zero!");
     }
+    if (y == -1) {
+        return __builtin_sub_overflow(0, *x, x) ? lop_overflow() : NULL;
+    }
+    *x /= y;
+    return NULL;
+}
 
-    lval *x = lval_pop(a, 0);
+static lval* lnum_mod(long long* x, long long y) {
+    if (y == 0) {
+        return lval_err("Division by Zero!");
+    }
+    *x = y == -1 ? 0 : *x % y;
+    return NULL;
+}
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        if (x->type == LVAL_NUM) {
-            x->data.num = -x->data.num;
+static lval* lnum_pow(long long* x, long long y) {
+    if (y < 0) {
+        *x = powl(*x, y);
+        return NULL;
+    }
+
+    long long base = *x;
+    long long r = 1;
+    while (y) {
+        if ((y & 1) && __builtin_mul_overflow(r, base, &r)) {
+            return lop_overflow();
         }
-        else if (x->type == LVAL_FLT) {
-            x->data.flt = -x->data.flt;
+        y >>= 1;
+        if (y && __builtin_mul_overflow(base, base, &base)) {
+            return lop_overflow();
         }
     }
+    *x = r;
+    return NULL;
+}
 
-    while (a->count > 0) {
-        lval *y = lval_pop(a, 0);
+static lval* lnum_min(long long* x, long long y) {
+    if (y < *x) {
+        *x = y;
+    }
+    return NULL;
+}
 
-        if (strcmp(op, "+") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                x->data.num += y->data.num;
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                x->data.flt += y->data.flt;
-            } else if (x->type == LVAL_FLT) {
-                x->data.flt += (double)y->data.num;
-            } else {
-                x->type = LVAL_FLT;
-                x->data.flt = (double)x->data.num + y->data.flt;
-            }
-        }
-        if (strcmp(op, "-") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                x->data.num -= y->data.num;
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                x->data.flt -= y->data.flt;
-            } else if (x->type == LVAL_FLT) {
-                x->data.flt -= (double)y->data.num;
-            } else {
-                x->type = LVAL_FLT;
-                x->data.flt = (double)x->data.num - y->data.flt;
-            }
-        }
-        if (strcmp(op, "*") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                x->data.num *= y->data.num;
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                x->data.flt *= y->data.flt;
-            } else if (x->type == LVAL_FLT) {
-                x->data.flt *= (double)y->data.num;
-            } else {
-                x->type = LVAL_FLT;
-                x->data.flt = (double)x->data.num * y->data.flt;
-            }
-        }
-        if (strcmp(op, "/") == 0) {
-            if ((y->type == LVAL_NUM && y->data.num == 0)
-                || (y->type == LVAL_FLT && y->data.flt == 0)) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by Zero!");
-                break;
-            }
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                x->data.num /= y->data.num;
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                x->data.flt /= y->data.flt;
-            } else if (x->type == LVAL_FLT) {
-                x->data.flt /= (double)y->data.num;
-            } else {
-                x->type = LVAL_FLT;
-                x->data.flt = (double)x->data.num / y->data.flt;
-            }
+static lval* lnum_max(long long* x, long long y) {
+    if (y > *x) {
+        *x = y;
+    }
+    return NULL;
+}
+
+static lval* lflt_add(double* x, double y) {
+    *x += y;
+    return NULL;
+}
+
+static lval* lflt_sub(double* x, double y) {
+    *x -= y;
+    return NULL;
+}
+
+static lval* lflt_mul(double* x, double y) {
+    *x *= y;
+    return NULL;
+}
+
+static lval* lflt_div(double* x, double y) {
+    if (y == 0) {
+        return lval_err("Division by Zero!");
+    }
+    *x /= y;
+    return NULL;
+}
+
+static lval* lflt_mod(double* x, double y) {
+    (void)x;
+    (void)y;
+    return lval_err("Cannot operate on floats!");
+}
+
+static lval* lflt_pow(double* x, double y) {
+    *x = pow(*x, y);
+    return NULL;
+}
+
+static const struct {
+    lnum_kernel num;
+    lflt_kernel flt;
+} lop_kernels[] = {
+    [LOP_ADD] = { lnum_add, lflt_add },
+    [LOP_SUB] = { lnum_sub, lflt_sub },
+    [LOP_MUL] = { lnum_mul, lflt_mul },
+    [LOP_DIV] = { lnum_div, lflt_div },
+    [LOP_MOD] = { lnum_mod, lflt_mod },
+    [LOP_POW] = { lnum_pow, lflt_pow },
+    [LOP_MIN] = { lnum_min, NULL },
+    [LOP_MAX] = { lnum_max, NULL },
+};
+
+static double lval_to_flt(lval* v) {
+    return v->type == LVAL_FLT ? v->data.flt : (double)v->data.num;
+}
+
+lval* builtin_op(lenv* e, int argc, lval** argv, enum lop op) {
+    lnum_kernel num = lop_kernels[op].num;
+    lflt_kernel flt = lop_kernels[op].flt;
+
+    /* Two integers, the common case. */
+    if (argc == 2 && argv[0]->type == LVAL_NUM && argv[1]->type == LVAL_NUM) {
+        long long x = argv[0]->data.num;
+        lval* err = num(&x, argv[1]->data.num);
+        return err ? err : lval_num(x);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]->type != LVAL_NUM && argv[i]->type != LVAL_FLT) {
+            return lval_err("Cannot operate on non-number!");
         }
-        if (strcmp(op, "%") == 0) {
-            if (x->type == LVAL_FLT || y->type == LVAL_FLT) {
-                return lval_err("Cannot operate on floats!");
-            }
-            if(y->data.num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by Zero!");
-                break;
-            }
-            x->data.num %= y->data.num;
-        }
-        if (strcmp(op, "**") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                x->data.num = powl(x->data.num, y->data.num);
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                x->data.flt = pow(x->data.flt, y->data.flt);
-            } else if (x->type == LVAL_FLT) {
-                x->data.flt = pow(x->data.flt, (double)y->data.num);
-            } else {
-                x->type = LVAL_FLT;
-                x->data.flt = pow((double)x->data.num, y->data.flt);
+    }
+
+    /* Accumulate in a value on the C stack and box only the result. */
+    lval acc = { .type = argv[0]->type, .data = argv[0]->data };
+    lval* x = &acc;
+
+    if (op == LOP_SUB && argc == 1) {
+        if (x->type == LVAL_NUM) {
+            if (__builtin_sub_overflow(0, x->data.num, &x->data.num)) {
+                return lop_overflow();
             }
         }
-        if (strcmp(op, "min") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                if (x->data.num > y->data.num) {
-                    x->data.num = y->data.num;
-                }
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                if (x->data.flt > y->data.flt) {
-                    x->data.flt = y->data.flt;
-                }
-            } else if (x->type == LVAL_FLT) {
-                if (x->data.flt > y->data.num) {
-                    x->type = LVAL_NUM;
-                    x->data.num = y->data.num;
-                }
-            } else {
-                if (x->data.num > y->data.flt) {
-                    x->type = LVAL_FLT;
-                    x->data.flt = y->data.flt;
-                }
-            }
+        else if (x->type == LVAL_FLT) {
+            x->data.flt = -x->data.flt;
         }
-        if (strcmp(op, "max") == 0) {
-            if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
-                if (x->data.num < y->data.num) {
-                    x->data.num = y->data.num;
-                }
-            } else if (x->type == LVAL_FLT && y->type == LVAL_FLT) {
-                if (x->data.flt < y->data.flt) {
-                    x->data.flt = y->data.flt;
-                }
-            } else if (x->type == LVAL_FLT) {
-                if (x->data.flt < y->data.num) {
-                    x->type = LVAL_NUM;
-                    x->data.num = y->data.num;
-                }
-            } else {
-                if (x->data.num < y->data.flt) {
-                    x->type = LVAL_FLT;
-                    x->data.flt = y->data.flt;
-                }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        lval* y = argv[i];
+        lval* err = NULL;
+
+        if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+            err = num(&x->data.num, y->data.num);
+        } else if (!flt) {
+            /* min and max keep the operand they pick as it is. */
+            double a = lval_to_flt(x);
+            double b = lval_to_flt(y);
+            if (op == LOP_MIN ? b < a : b > a) {
+                x->type = y->type;
+                x->data = y->data;
             }
+        } else {
+            x->data.flt = lval_to_flt(x);
+            x->type = LVAL_FLT;
+            err = flt(&x->data.flt, lval_to_flt(y));
         }
 
-        lval_del(y);
+        if (err) {
+            return err;
+        }
     }
 
-    lval_del(a);
-    return x;
+    if (x->type == LVAL_FLT) {
+        return lval_flt(x->data.flt);
+    }
+    return lval_num(x->data.num);
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM("head", a, 1);
-    if (a->cell[0]->type == LVAL_QEXPR) {
-        LASSERT_NOT_EMPTY("head", a, 0);
+lval* builtin_head(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("head", argc, 1);
+    if (argv[0]->type == LVAL_QEXPR) {
+        LASSERT_ARGV_NOT_EMPTY("head", argv, 0);
 
-        lval* v = lval_take(a, 0);
-        while (v->count > 1) {
-            lval_del(lval_pop(v, 1));
-        }
-        return v;
+        return lval_slice(lval_take_arg(argv, 0), 0, 1);
     }
-    if (a->cell[0]->type == LVAL_STR) {
-        if (strlen(a->cell[0]->data.str) == 0) {
+    if (argv[0]->type == LVAL_STR) {
+        if (argv[0]->len == 0) {
             return lval_err("Can not take 'head' of empty string");
         }
-        char* s = malloc(2);
-        s[0] = a->cell[0]->data.str[0];
-        s[1] = '\0';
-        lval* v = lval_str(s);
-        free(s);
-        return v;
+        return lval_strn(argv[0]->data.str, 1);
     }
     return lval_err("Function 'head' passed incorrect type. "
-        "Got %s, Expected Q-Expression or String.", ltype_name(a->cell[0]->type));
+        "Got %s, Expected Q-Expression or String.", ltype_name(argv[0]->type));
 }
 
-lval* builtin_tail(lenv* e, lval *a) {
-    LASSERT_NUM("tail", a, 1);
-    if (a->cell[0]->type == LVAL_QEXPR) {
-        LASSERT_NOT_EMPTY("tail", a, 0);
+lval* builtin_tail(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("tail", argc, 1);
+    if (argv[0]->type == LVAL_QEXPR) {
+        LASSERT_ARGV_NOT_EMPTY("tail", argv, 0);
 
-        lval *v = lval_take(a, 0);
-        lval_del(lval_pop(v, 0));
-        return v;
+        lval *v = lval_take_arg(argv, 0);
+        return lval_slice(v, 1, v->count - 1);
     }
-    if (a->cell[0]->type == LVAL_STR) {
-        if (strlen(a->cell[0]->data.str) == 0) {
+    if (argv[0]->type == LVAL_STR) {
+        if (argv[0]->len == 0) {
             return lval_err("Can not take 'tail' of empty string");
         }
-        if (strlen(a->cell[0]->data.str) == 1) {
-            return lval_str("");
-        }
-        char* s = malloc(strlen(a->cell[0]->data.str));
-        strcpy(s, a->cell[0]->data.str + 1);
-        lval* v = lval_str(s);
-        free(s);
-        return v;
+        return lval_strn(argv[0]->data.str + 1, argv[0]->len - 1);
     }
-        return lval_err("Function 'tail' passed incorrect type. "
-    "Got %s, Expected Q-Expression or String.", ltype_name(a->cell[0]->type));
+    return lval_err("Function 'tail' passed incorrect type. "
+        "Got %s, Expected Q-Expression or String.", ltype_name(argv[0]->type));
 }
 
 
-lval* builtin_join(lenv* e,lval* a) {
-    if (a->cell[0]->type == LVAL_QEXPR) {
-        for (int i = 0; i < a->count; i++) {
-            LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+lval* builtin_join(lenv* e, int argc, lval** argv) {
+    if (argv[0]->type == LVAL_QEXPR) {
+        for (int i = 0; i < argc; i++) {
+            LASSERT_ARGV_TYPE("join", argv, i, LVAL_QEXPR);
         }
 
-        lval *x = lval_pop(a, 0);
-
-        while (a->count) {
-            x = lval_join(x, lval_pop(a, 0));
+        lval *x = lval_take_arg(argv, 0);
+        for (int i = 1; i < argc; i++) {
+            x = lval_join(x, lval_take_arg(argv, i));
         }
-        lval_del(a);
         return x;
     }
-    if (a->cell[0]->type == LVAL_STR) {
-        for (int i = 0; i < a->count; i++) {
-            LASSERT_TYPE("join", a, i, LVAL_STR);
+    if (argv[0]->type == LVAL_STR) {
+        for (int i = 0; i < argc; i++) {
+            LASSERT_ARGV_TYPE("join", argv, i, LVAL_STR);
         }
 
-        lval *x = lval_pop(a, 0);
-
-        while (a->count) {
-            lval* y = lval_pop(a, 0);
-            x->data.str = strcat(x->data.str, y->data.str);
-            lval_del(y);
+        lval *x = lval_take_arg(argv, 0);
+        for (int i = 1; i < argc; i++) {
+            x = lval_str_join(x, lval_take_arg(argv, i));
         }
-        lval_del(a);
         return x;
     }
     return lval_err("Function 'join' passed incorrect type. "
-        "Got %s, Expected Q-Expression or String.", ltype_name(a->cell[0]->type));
+        "Got %s, Expected Q-Expression or String.", ltype_name(argv[0]->type));
 }
 
-lval* builtin_len(lenv* e,lval* a) {
-    LASSERT_NUM("len", a, 1);
-    if (a->cell[0]->type == LVAL_QEXPR) {
-        lval* x = lval_num(a->cell[0]->count);
-        lval_del(a);
+lval* builtin_len(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("len", argc, 1);
+    if (argv[0]->type == LVAL_QEXPR) {
+        return lval_num(argv[0]->count);
+    }
+    if (argv[0]->type == LVAL_STR) {
+        return lval_num(argv[0]->len);
+    }
+    return lval_err("Function 'len' passed incorrect type. "
+        "Got %s, Expected Q-Expression or String.", ltype_name(argv[0]->type));
+}
+
+/*
+ * List library. These used to be written in the prelude, recursing over
+ * the list and rebuilding it with join at every step; here each is one
+ * pass. An element is read the way the prelude's fst reads it, by
+ * evaluating it. Arguments used after evaluating anything are read out of
+ * argv first, as evaluating may move the stack argv points into.
+ */
+static lval* lval_elem(lenv* e, lval* l, int i) {
+    if (l->type == LVAL_STR) {
+        return lval_strn(l->data.str + i, 1);
+    }
+    return lval_eval(e, lval_copy(l->cell[i]));
+}
+
+static int lval_length(lval* l) {
+    return l->type == LVAL_STR ? l->len : l->count;
+}
+
+/*
+ * The count items of l from start, consuming l.
+ */
+static lval* lval_sub(lval* l, int start, int count) {
+    if (l->type == LVAL_STR) {
+        lval* x = lval_strn(l->data.str + start, count);
+        lval_del(l);
         return x;
     }
-    if (a->cell[0]->type == LVAL_STR) {
-        lval* x = lval_num(strlen(a->cell[0]->data.str));
-        lval_del(a);
+    return lval_slice(l, start, count);
+}
+
+/*
+ * The functions taking a function to call go through the list with
+ * lval_resume(), so what they call runs as a frame of the machine. Their
+ * state is {f l acc}: the function, the list and what is built so far.
+ * Values are asked for in turns, the item i first and then f on it, so
+ * an odd k is given item k / 2, and an even k, past 0, f on the item
+ * before k / 2.
+ */
+enum { LSTEP_F, LSTEP_LIST, LSTEP_ACC };
+
+static lval* lstep_new(lval** argv, int f, int l, lval* acc) {
+    lval* s = lval_add(lval_qexpr(), lval_take_arg(argv, f));
+    s = lval_add(s, lval_take_arg(argv, l));
+    return lval_add(s, acc);
+}
+
+/*
+ * Asks for item i of the list, or returns what was built once there are
+ * no more.
+ */
+static lval* lstep_item(lenv* e, lval* s, int i) {
+    lval* l = s->cell[LSTEP_LIST];
+    if (i == l->count) {
+        return lval_copy(s->cell[LSTEP_ACC]);
+    }
+    return lval_resume_eval(e, lval_copy(l->cell[i]));
+}
+
+lval* builtin_nth(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("nth", argc, 2);
+    LASSERT_ARGV_TYPE("nth", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_LIST("nth", argv, 1);
+
+    long long n = argv[0]->data.num;
+    int len = lval_length(argv[1]);
+    LASSERT_ARGV_INDEX("nth", n, len, len - 1);
+    return lval_elem(e, argv[1], n);
+}
+
+lval* builtin_last(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("last", argc, 1);
+    LASSERT_ARGV_LIST("last", argv, 0);
+    LASSERT_ARGV(lval_length(argv[0]), "Function 'last' passed {} for argument 0.");
+
+    return lval_elem(e, argv[0], lval_length(argv[0]) - 1);
+}
+
+lval* builtin_take(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("take", argc, 2);
+    LASSERT_ARGV_TYPE("take", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_LIST("take", argv, 1);
+
+    long long n = argv[0]->data.num;
+    int len = lval_length(argv[1]);
+    LASSERT_ARGV_INDEX("take", n, len, len);
+    return lval_sub(lval_take_arg(argv, 1), 0, n);
+}
+
+lval* builtin_drop(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("drop", argc, 2);
+    LASSERT_ARGV_TYPE("drop", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_LIST("drop", argv, 1);
+
+    long long n = argv[0]->data.num;
+    int len = lval_length(argv[1]);
+    LASSERT_ARGV_INDEX("drop", n, len, len);
+    return lval_sub(lval_take_arg(argv, 1), n, len - n);
+}
+
+lval* builtin_split(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("split", argc, 2);
+    LASSERT_ARGV_TYPE("split", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_LIST("split", argv, 1);
+
+    long long n = argv[0]->data.num;
+    int len = lval_length(argv[1]);
+    LASSERT_ARGV_INDEX("split", n, len, len);
+    lval* l = lval_take_arg(argv, 1);
+    lval* x = lval_add(lval_qexpr(), lval_sub(lval_copy(l), 0, n));
+    return lval_add(x, lval_sub(l, n, len - n));
+}
+
+lval* builtin_elem(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("elem", argc, 2);
+    LASSERT_ARGV_TYPE("elem", argv, 1, LVAL_QEXPR);
+
+    lval* x = argv[0];
+    lval* l = argv[1];
+    for (int i = 0; i < l->count; i++) {
+        lval* y = lval_elem(e, l, i);
+        if (y->type == LVAL_ERR) {
+            return y;
+        }
+        int r = lval_eq(x, y);
+        lval_del(y);
+        if (r) {
+            return lval_num(1);
+        }
+    }
+    return lval_num(0);
+}
+
+static lval* builtin_map_step(lenv* e, lval* s, int k, lval* x) {
+    if (x && x->type == LVAL_ERR) {
         return x;
     }
-    return lval_err("Function 'len' passed incorrect type. "
-        "Got %s, Expected Q-Expression or String.", ltype_name(a->cell[0]->type));
+    if (k % 2) {
+        return lval_resume_call(lval_copy(s->cell[LSTEP_F]), 1, &x);
+    }
+    if (x) {
+        s->cell[LSTEP_ACC] = lval_add(s->cell[LSTEP_ACC], x);
+    }
+    return lstep_item(e, s, k / 2);
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+lval* builtin_map(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("map", argc, 2);
+    LASSERT_ARGV_TYPE("map", argv, 0, LVAL_FUN);
+    LASSERT_ARGV_TYPE("map", argv, 1, LVAL_QEXPR);
+
+    return lval_resume(e, builtin_map_step, lstep_new(argv, 0, 1, lval_qexpr()));
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+static lval* builtin_filter_step(lenv* e, lval* s, int k, lval* x) {
+    if (x && x->type == LVAL_ERR) {
+        return x;
+    }
+    if (k % 2) {
+        return lval_resume_call(lval_copy(s->cell[LSTEP_F]), 1, &x);
+    }
+    if (x) {
+        if (x->type != LVAL_NUM) {
+            lval* err = lval_err(
+                "Function 'filter' passed a function returning %s, "
+                "Expected %s.", ltype_name(x->type), ltype_name(LVAL_NUM));
+            lval_del(x);
+            return err;
+        }
+        if (x->data.num) {
+            s->cell[LSTEP_ACC] = lval_add(s->cell[LSTEP_ACC],
+                lval_copy(s->cell[LSTEP_LIST]->cell[k / 2 - 1]));
+        }
+        lval_del(x);
+    }
+    return lstep_item(e, s, k / 2);
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+lval* builtin_filter(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("filter", argc, 2);
+    LASSERT_ARGV_TYPE("filter", argv, 0, LVAL_FUN);
+    LASSERT_ARGV_TYPE("filter", argv, 1, LVAL_QEXPR);
+
+    return lval_resume(e, builtin_filter_step, lstep_new(argv, 0, 1, lval_qexpr()));
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+/*
+ * foldl and foldr differ only in the order they take the items in and
+ * the side of f the accumulator goes on.
+ */
+static lval* lval_fold_step(lenv* e, lval* s, int k, lval* x, int right) {
+    if (x && x->type == LVAL_ERR) {
+        return x;
+    }
+    if (k % 2) {
+        lval* acc = s->cell[LSTEP_ACC];
+        s->cell[LSTEP_ACC] = lval_sexpr();
+        lval* a[2] = { right ? x : acc, right ? acc : x };
+        return lval_resume_call(lval_copy(s->cell[LSTEP_F]), 2, a);
+    }
+    if (x) {
+        lval_del(s->cell[LSTEP_ACC]);
+        s->cell[LSTEP_ACC] = x;
+    }
+    int i = k / 2;
+    int n = s->cell[LSTEP_LIST]->count;
+    return lstep_item(e, s, right && i < n ? n - 1 - i : i);
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-    return builtin_op(e, a, "%");
+static lval* builtin_foldl_step(lenv* e, lval* s, int k, lval* x) {
+    return lval_fold_step(e, s, k, x, 0);
 }
 
-lval* builtin_pow(lenv* e, lval* a) {
-    return builtin_op(e, a, "**");
+static lval* builtin_foldr_step(lenv* e, lval* s, int k, lval* x) {
+    return lval_fold_step(e, s, k, x, 1);
 }
 
-lval* builtin_min(lenv* e, lval* a) {
-    return builtin_op(e, a, "min");
+lval* builtin_foldl(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("foldl", argc, 3);
+    LASSERT_ARGV_TYPE("foldl", argv, 0, LVAL_FUN);
+    LASSERT_ARGV_TYPE("foldl", argv, 2, LVAL_QEXPR);
+
+    lval* acc = lval_take_arg(argv, 1);
+    return lval_resume(e, builtin_foldl_step, lstep_new(argv, 0, 2, acc));
 }
 
-lval* builtin_max(lenv* e, lval* a) {
-    return builtin_op(e, a, "max");
+lval* builtin_foldr(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("foldr", argc, 3);
+    LASSERT_ARGV_TYPE("foldr", argv, 0, LVAL_FUN);
+    LASSERT_ARGV_TYPE("foldr", argv, 2, LVAL_QEXPR);
+
+    lval* acc = lval_take_arg(argv, 1);
+    return lval_resume(e, builtin_foldr_step, lstep_new(argv, 0, 2, acc));
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+lval* builtin_reverse(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("reverse", argc, 1);
+    LASSERT_ARGV_LIST("reverse", argv, 0);
 
-    lval* syms = a->cell[0];
+    lval* l = argv[0];
+    if (l->type == LVAL_STR) {
+        char* s = malloc(l->len + 1);
+        for (int i = 0; i < l->len; i++) {
+            s[i] = l->data.str[l->len - 1 - i];
+        }
+        lval* x = lval_strn(s, l->len);
+        free(s);
+        return x;
+    }
+
+    lval* x = lval_qexpr();
+    for (int i = l->count - 1; i >= 0; i--) {
+        x = lval_add(x, lval_copy(l->cell[i]));
+    }
+    return x;
+}
+
+lval* builtin_zip(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("zip", argc, 2);
+    LASSERT_ARGV_TYPE("zip", argv, 0, LVAL_QEXPR);
+    LASSERT_ARGV_TYPE("zip", argv, 1, LVAL_QEXPR);
+
+    lval* x = argv[0];
+    lval* y = argv[1];
+    lval* r = lval_qexpr();
+    for (int i = 0; i < x->count && i < y->count; i++) {
+        lval* p = lval_add(lval_qexpr(), lval_copy(x->cell[i]));
+        r = lval_add(r, lval_add(p, lval_copy(y->cell[i])));
+    }
+    return r;
+}
+
+lval* builtin_range(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("range", argc, 3);
+    LASSERT_ARGV_TYPE("range", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_TYPE("range", argv, 1, LVAL_NUM);
+    LASSERT_ARGV_TYPE("range", argv, 2, LVAL_NUM);
+
+    long long start = argv[0]->data.num;
+    long long end = argv[1]->data.num;
+    long long step = argv[2]->data.num;
+    LASSERT_ARGV(step != 0 || start == end, "Function 'range' passed a step of 0.");
+
+    lval* r = lval_qexpr();
+    for (long long x = start; step > 0 ? x < end : x > end; x += step) {
+        r = lval_add(r, lval_num(x));
+    }
+    return r;
+}
+
+/*
+ * Finds the first of the {condition value} pairs whose condition is
+ * true, or for case equal to x, and evaluates its value. Resumed with
+ * the state {cs} or {cs x}, given the condition of pair k - 1 as c.
+ */
+static lval* lval_select_step(lenv* e, lval* s, int k, lval* c) {
+    lval* cs = s->cell[0];
+    lval* x = s->count > 1 ? s->cell[1] : NULL;
+
+    if (c) {
+        if (c->type == LVAL_ERR) {
+            return c;
+        }
+        if (!x && c->type != LVAL_NUM) {
+            lval* err = lval_err(
+                "Function 'select' passed a condition of type %s, Expected %s.",
+                ltype_name(c->type), ltype_name(LVAL_NUM));
+            lval_del(c);
+            return err;
+        }
+        int r = x ? lval_eq(x, c) : c->data.num != 0;
+        lval_del(c);
+
+        if (r) {
+            return lval_eval_qexpr(e, lval_slice(lval_copy(cs->cell[k - 1]), 1, 1));
+        }
+    }
+
+    if (k == cs->count) {
+        return lval_err(x ? "No Case Found" : "No Selection Found");
+    }
+    return lval_resume_eval(e, lval_copy(cs->cell[k]->cell[0]));
+}
+
+static lval* lval_select(lenv* e, char* func, lval* x, int argc, lval** argv) {
+    lval* cs = lval_qexpr();
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]->type != LVAL_QEXPR || argv[i]->count != 2) {
+            lval_del(cs);
+            return lval_err(
+                "Function '%s' passed incorrect type for argument %i. "
+                "Got %s, Expected a Q-Expression of two items.", func,
+                x ? i + 1 : i, ltype_name(argv[i]->type));
+        }
+        cs = lval_add(cs, lval_copy(argv[i]));
+    }
+
+    lval* s = lval_add(lval_qexpr(), cs);
+    if (x) {
+        s = lval_add(s, lval_copy(x));
+    }
+    return lval_resume(e, lval_select_step, s);
+}
+
+lval* builtin_select(lenv* e, int argc, lval** argv) {
+    return lval_select(e, "select", NULL, argc, argv);
+}
+
+lval* builtin_case(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV(argc >= 1,
+        "Function 'case' passed incorrect number of arguments. "
+        "Got %i, Expected at least %i.", argc, 1);
+    return lval_select(e, "case", argv[0], argc - 1, argv + 1);
+}
+
+lval* builtin_add(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_ADD);
+}
+
+lval* builtin_sub(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_SUB);
+}
+
+lval* builtin_mul(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_MUL);
+}
+
+lval* builtin_div(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_DIV);
+}
+
+lval* builtin_mod(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_MOD);
+}
+
+lval* builtin_pow(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_POW);
+}
+
+lval* builtin_min(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_MIN);
+}
+
+lval* builtin_max(lenv* e, int argc, lval** argv) {
+    return builtin_op(e, argc, argv, LOP_MAX);
+}
+
+lval* builtin_var(lenv* e, int argc, lval** argv, char* func) {
+    LASSERT_ARGV(argc >= 1,
+        "Function '%s' passed incorrect number of arguments. "
+        "Got %i, Expected at least %i.", func, argc, 1);
+    LASSERT_ARGV_TYPE(func, argv, 0, LVAL_QEXPR);
+
+    lval* syms = argv[0];
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT_ARGV((syms->cell[i]->type == LVAL_SYM),
             "Function '%s' cannot define non-symbol. "
             "Got %s, expected %s.", func,
             ltype_name(syms->cell[i]->type),
             ltype_name(LVAL_SYM));
     }
 
-    LASSERT(a, (syms->count == a->count - 1),
+    LASSERT_ARGV((syms->count == argc - 1),
         "Function '%s' passed too many arguments for symbols. "
-        "Got %i, expected %i.", func, syms->count, a->count - 1);
+        "Got %i, expected %i.", func, syms->count, argc - 1);
 
     for (int i = 0; i < syms->count; i++) {
         if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+            lenv_def(e, syms->cell[i], argv[i + 1]);
         }
 
         if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+            lenv_put(e, syms->cell[i], argv[i + 1]);
         }
     }
 
-    lval_del(a);
     return lval_sexpr();
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+lval* builtin_def(lenv* e, int argc, lval** argv) {
+    return builtin_var(e, argc, argv, "def");
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+lval* builtin_put(lenv* e, int argc, lval** argv) {
+    return builtin_var(e, argc, argv, "=");
 }
 
 lval* builtin_exit(lenv* e, lval* a) {
@@ -369,6 +768,9 @@ lval* builtin_exit(lenv* e, lval* a) {
 
 lval* builtin_state(lenv* e, lval* a) {
     for (int i = 0; i < e->count; i++) {
+        if (!e->vals[i]) {
+            continue;
+        }
         printf("%s = ", e->syms[i]);
         lval_print(e, e->vals[i]);
         printf("\n");
@@ -377,230 +779,250 @@ lval* builtin_state(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    (void)e;
+    lgc_stats s = lgc_get_stats();
+    printf("collections = %lli\n", s.collections);
+    printf("pause total = %.3f ms\n", s.pause_total);
+    printf("pause max = %.3f ms\n", s.pause_max);
+    printf("live bytes = %lli\n", s.live_bytes);
+    printf("peak bytes = %lli\n", s.peak_bytes);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_memo(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV(argc == 1 || argc == 2,
+        "Function 'memo' passed incorrect number of arguments. "
+        "Got %i, Expected 1 or 2.", argc);
+    LASSERT_ARGV_TYPE("memo", argv, 0, LVAL_FUN);
+
+    int max = 0;
+    if (argc == 2) {
+        LASSERT_ARGV_TYPE("memo", argv, 1, LVAL_NUM);
+        LASSERT_ARGV(argv[1]->data.num > 0 && argv[1]->data.num <= INT_MAX,
+            "Function 'memo' passed a size of %lli, Expected a positive Number.",
+            argv[1]->data.num);
+        max = argv[1]->data.num;
+    }
+    return lval_memo(lval_take_arg(argv, 0), max);
+}
+
+lval* builtin_memo_stats(lenv* e, int argc, lval** argv) {
+    (void)e;
+    LASSERT_ARGV_NUM("memo-stats", argc, 1);
+    lmemo_stats s;
+    LASSERT_ARGV(lval_memo_stats(argv[0], &s),
+        "Function 'memo-stats' passed a function that is not memoised.");
+
+    printf("hits = %lli\n", s.hits);
+    printf("misses = %lli\n", s.misses);
+    printf("evictions = %lli\n", s.evictions);
+    printf("size = %i\n", s.size);
+    printf("max = %i\n", s.max);
+    return lval_sexpr();
+}
+
+lval* builtin_lambda(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("\\", argc, 2);
+    LASSERT_ARGV_TYPE("\\", argv, 0, LVAL_QEXPR);
+    LASSERT_ARGV_TYPE("\\", argv, 1, LVAL_QEXPR);
 
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+    for (int i = 0; i < argv[0]->count; i++) {
+        LASSERT_ARGV((argv[0]->cell[i]->type == LVAL_SYM),
             "Cannot define non-symbol. Got %s, expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM)
+            ltype_name(argv[0]->cell[i]->type), ltype_name(LVAL_SYM)
         );
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
-
+    lval* formals = lval_take_arg(argv, 0);
+    lval* body = lval_take_arg(argv, 1);
     return lval_lambda(formals, body);
 }
 
+lval* builtin_do(lenv* e, int argc, lval** argv) {
+    (void)e;
+    if (argc == 0) {
+        return lval_qexpr();
+    }
+    return lval_take_arg(argv, argc - 1);
+}
+
+lval* builtin_let(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("let", argc, 1);
+    LASSERT_ARGV_TYPE("let", argv, 0, LVAL_QEXPR);
+
+    return lval_eval_scope(e, lval_take_arg(argv, 0));
+}
+
 lval* builtin_load(lenv* e, lval* a) {
     LASSERT_NUM("load", a, 1);
     LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->data.str, Lzp, &r)) {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    lgc_push(a);
+    lval* x = lval_load_file(e, a->cell[0]->data.str);
+    lgc_pop(1);
 
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
+    lval_del(a);
+    return x;
+}
 
-            if (x->type == LVAL_ERR) {
-                lval_println(e, x);
-            }
-            lval_del(x);
-        }
+lval* builtin_save_image(lenv* e, lval* a) {
+    LASSERT_NUM("save-image", a, 1);
+    LASSERT_TYPE("save-image", a, 0, LVAL_STR);
 
-        lval_del(expr);
-        lval_del(a);
+    lval* x = lenv_save_image(e, a->cell[0]->data.str);
+    lval_del(a);
+    return x;
+}
 
-        return lval_sexpr();
-    } else {
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+lval* builtin_load_image(lenv* e, lval* a) {
+    LASSERT_NUM("load-image", a, 1);
+    LASSERT_TYPE("load-image", a, 0, LVAL_STR);
 
-        lval* err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    lval* x = lenv_load_image_file(e, a->cell[0]->data.str);
+    lval_del(a);
+    return x;
+}
 
-        return err;
-    }
+lval* builtin_cmp(lenv* e, int argc, lval** argv, enum lop op) {
+    LASSERT_ARGV_NUM(lop_names[op], argc, 2);
+    int r = lval_eq(argv[0], argv[1]);
+    return lval_num(op == LOP_EQ ? r : !r);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    int r = 0;
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
-    }
-    lval_del(a);
-    return lval_num(r);
+lval* builtin_eq(lenv* e, int argc, lval** argv) {
+    return builtin_cmp(e, argc, argv, LOP_EQ);
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+lval* builtin_ne(lenv* e, int argc, lval** argv) {
+    return builtin_cmp(e, argc, argv, LOP_NE);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+lval* builtin_if(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("if", argc, 3);
+    LASSERT_ARGV_TYPE("if", argv, 0, LVAL_NUM);
+    LASSERT_ARGV_TYPE("if", argv, 1, LVAL_QEXPR);
+    LASSERT_ARGV_TYPE("if", argv, 2, LVAL_QEXPR);
+
+    return lval_eval_qexpr(e, lval_take_arg(argv, argv[0]->data.num ? 1 : 2));
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+/*
+ * Comparison kernels, one for each operator and operand type.
+ */
+typedef int (*lnum_order)(long long x, long long y);
+typedef int (*lflt_order)(double x, double y);
 
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+static int lnum_gt(long long x, long long y) {
+    return x > y;
+}
 
-    if (a->cell[0]->data.num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+static int lnum_lt(long long x, long long y) {
+    return x < y;
+}
 
-    lval_del(a);
-    return x;
+static int lnum_ge(long long x, long long y) {
+    return x >= y;
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    if ((a->cell[0]->type != LVAL_NUM && a->cell[0]->type != LVAL_FLT) ||
-        (a->cell[1]->type != LVAL_NUM && a->cell[1]->type != LVAL_FLT)) {
-        return lval_err("Cannot operate on non-number!");
-    }
+static int lnum_le(long long x, long long y) {
+    return x <= y;
+}
 
-    int r = 0;
-    if (strcmp(op, ">") == 0) {
-        if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
-            r = (a->cell[0]->data.num > a->cell[1]->data.num);
-        } else if (a->cell[0]->type == LVAL_FLT && a->cell[1]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt > a->cell[1]->data.flt);
-        } else if (a->cell[0]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt > a->cell[1]->data.num);
-        } else {
-            r = (a->cell[0]->data.num > a->cell[1]->data.flt);
-        }
-    }
-    if (strcmp(op, "<") == 0) {
-        if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
-            r = (a->cell[0]->data.num < a->cell[1]->data.num);
-        } else if (a->cell[0]->type == LVAL_FLT && a->cell[1]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt < a->cell[1]->data.flt);
-        } else if (a->cell[0]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt < a->cell[1]->data.num);
-        } else {
-            r = (a->cell[0]->data.num < a->cell[1]->data.flt);
-        }
-    }
-    if (strcmp(op, ">=") == 0) {
-        if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
-            r = (a->cell[0]->data.num >= a->cell[1]->data.num);
-        } else if (a->cell[0]->type == LVAL_FLT && a->cell[1]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt >= a->cell[1]->data.flt);
-        } else if (a->cell[0]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt >= a->cell[1]->data.num);
-        } else {
-            r = (a->cell[0]->data.num >= a->cell[1]->data.flt);
-        }
+static int lflt_gt(double x, double y) {
+    return x > y;
+}
+
+static int lflt_lt(double x, double y) {
+    return x < y;
+}
+
+static int lflt_ge(double x, double y) {
+    return x >= y;
+}
+
+static int lflt_le(double x, double y) {
+    return x <= y;
+}
+
+static const struct {
+    lnum_order num;
+    lflt_order flt;
+} lord_kernels[] = {
+    [LOP_GT] = { lnum_gt, lflt_gt },
+    [LOP_LT] = { lnum_lt, lflt_lt },
+    [LOP_GE] = { lnum_ge, lflt_ge },
+    [LOP_LE] = { lnum_le, lflt_le },
+};
+
+lval* builtin_ord(lenv* e, int argc, lval** argv, enum lop op) {
+    LASSERT_ARGV_NUM(lop_names[op], argc, 2);
+    lval* x = argv[0];
+    lval* y = argv[1];
+
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+        return lval_num(lord_kernels[op].num(x->data.num, y->data.num));
     }
-    if (strcmp(op, "<=") == 0) {
-        if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
-            r = (a->cell[0]->data.num <= a->cell[1]->data.num);
-        } else if (a->cell[0]->type == LVAL_FLT && a->cell[1]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt <= a->cell[1]->data.flt);
-        } else if (a->cell[0]->type == LVAL_FLT) {
-            r = (a->cell[0]->data.flt <= a->cell[1]->data.num);
-        } else {
-            r = (a->cell[0]->data.num <= a->cell[2]->data.flt);
-        }
+    if ((x->type != LVAL_NUM && x->type != LVAL_FLT) ||
+        (y->type != LVAL_NUM && y->type != LVAL_FLT)) {
+        return lval_err("Cannot operate on non-number!");
     }
-    lval_del(a);
-    return lval_num(r);
+    return lval_num(lord_kernels[op].flt(lval_to_flt(x), lval_to_flt(y)));
 }
 
-lval* builtin_log(lenv* e, lval* a, char* op) {
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
+lval* builtin_log(lenv* e, int argc, lval** argv, enum lop op) {
+    for (int i = 0; i < argc; i++) {
+        if (argv[i]->type != LVAL_NUM) {
             return lval_err("Cannot operate on non-number!");
         }
     }
-    
-    lval* x = lval_pop(a, 0);
 
-    if (a->count == 0 && strcmp(op, "!") == 0) {
-        if (x->data.num == 0) {
-            x->data.num = 1;
-        } else {
-            x->data.num = 0;
-        }
+    int r = argv[0]->data.num != 0;
+    if (op == LOP_NOT && argc == 1) {
+        r = !r;
     }
 
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        if (strcmp(op, "||") == 0) {
-            if (x->data.num || y->data.num) {
-                x->data.num = 1;
-            } else {
-                x->data.num = 0;
-            }
+    for (int i = 1; i < argc; i++) {
+        if (op == LOP_OR) {
+            r = r || argv[i]->data.num;
         }
-
-        if (strcmp(op, "&&") == 0) {
-            if (x->data.num && y->data.num) {
-                x->data.num = 1;
-            } else {
-                x->data.num = 0;
-            }
+        if (op == LOP_AND) {
+            r = r && argv[i]->data.num;
         }
-        lval_del(y);
     }
 
-    lval_del(a);
-    if (x->data.num) {
-        x->data.num = 1;
-    } else {
-        x->data.num = 0;
-    }
-    return x;
+    return lval_num(r);
 }
 
-lval* builtin_not(lenv* e, lval* a) {
-    LASSERT_NUM("!", a, 1);
-    return builtin_log(e, a, "!");
+lval* builtin_not(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("!", argc, 1);
+    return builtin_log(e, argc, argv, LOP_NOT);
 }
 
-lval* builtin_or(lenv* e, lval* a) {
-    return builtin_log(e, a, "||");
+lval* builtin_or(lenv* e, int argc, lval** argv) {
+    return builtin_log(e, argc, argv, LOP_OR);
 }
 
-lval* builtin_and(lenv* e, lval* a) {
-    return builtin_log(e, a, "&&");
+lval* builtin_and(lenv* e, int argc, lval** argv) {
+    return builtin_log(e, argc, argv, LOP_AND);
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+lval* builtin_gt(lenv* e, int argc, lval** argv) {
+    return builtin_ord(e, argc, argv, LOP_GT);
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+lval* builtin_lt(lenv* e, int argc, lval** argv) {
+    return builtin_ord(e, argc, argv, LOP_LT);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+lval* builtin_ge(lenv* e, int argc, lval** argv) {
+    return builtin_ord(e, argc, argv, LOP_GE);
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+lval* builtin_le(lenv* e, int argc, lval** argv) {
+    return builtin_ord(e, argc, argv, LOP_LE);
 }
 
 lval* builtin_print(lenv* e, lval* a) {
@@ -632,6 +1054,8 @@ lval* builtin_str(lenv* e, lval* a) {
     LASSERT_NUM("str", a, 1);
     char* s = lval_string(e, a->cell[0]);
     lval* r = lval_str(s);
+    free(s);
+    lval_del(a);
 
     return r;
 }
@@ -717,41 +1141,63 @@ lval* builtin_plugin(lenv* e, lval* a) {
 }
 
 void lenv_add_builtins(lenv* e) {
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin_argv(e, "list", builtin_list);
+    lenv_add_builtin_argv(e, "head", builtin_head);
+    lenv_add_builtin_argv(e, "tail", builtin_tail);
+    lenv_add_builtin_argv(e, "eval", builtin_eval);
+    lenv_add_builtin_argv(e, "join", builtin_join);
+    lenv_add_builtin_argv(e, "len", builtin_len);
+    lenv_add_builtin_argv(e, "nth", builtin_nth);
+    lenv_add_builtin_argv(e, "last", builtin_last);
+    lenv_add_builtin_argv(e, "take", builtin_take);
+    lenv_add_builtin_argv(e, "drop", builtin_drop);
+    lenv_add_builtin_argv(e, "split", builtin_split);
+    lenv_add_builtin_argv(e, "elem", builtin_elem);
+    lenv_add_builtin_argv(e, "map", builtin_map);
+    lenv_add_builtin_argv(e, "filter", builtin_filter);
+    lenv_add_builtin_argv(e, "foldl", builtin_foldl);
+    lenv_add_builtin_argv(e, "foldr", builtin_foldr);
+    lenv_add_builtin_argv(e, "reverse", builtin_reverse);
+    lenv_add_builtin_argv(e, "zip", builtin_zip);
+    lenv_add_builtin_argv(e, "range", builtin_range);
+    lenv_add_builtin_argv(e, "select", builtin_select);
+    lenv_add_builtin_argv(e, "case", builtin_case);
     
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
-    lenv_add_builtin(e, "**", builtin_pow);
-    lenv_add_builtin(e, "min", builtin_min);
-    lenv_add_builtin(e, "max", builtin_max);
-
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "=", builtin_put);
+    lenv_add_builtin_argv(e, "+", builtin_add);
+    lenv_add_builtin_argv(e, "-", builtin_sub);
+    lenv_add_builtin_argv(e, "*", builtin_mul);
+    lenv_add_builtin_argv(e, "/", builtin_div);
+    lenv_add_builtin_argv(e, "%", builtin_mod);
+    lenv_add_builtin_argv(e, "**", builtin_pow);
+    lenv_add_builtin_argv(e, "min", builtin_min);
+    lenv_add_builtin_argv(e, "max", builtin_max);
+
+    lenv_add_form(e, "def", builtin_def, LFORM_DEF);
+    lenv_add_form(e, "\\", builtin_lambda, LFORM_LAMBDA);
+    lenv_add_form(e, "=", builtin_put, LFORM_PUT);
+    lenv_add_form(e, "do", builtin_do, LFORM_DO);
+    lenv_add_form(e, "let", builtin_let, LFORM_LET);
 
     lenv_add_builtin(e, "exit", builtin_exit);
     lenv_add_builtin(e, "state", builtin_state);
-
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "!", builtin_not);
-    lenv_add_builtin(e, "||", builtin_or);
-    lenv_add_builtin(e, "&&", builtin_and);
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
+    lenv_add_builtin_argv(e, "memo", builtin_memo);
+    lenv_add_builtin_argv(e, "memo-stats", builtin_memo_stats);
+
+    lenv_add_builtin_argv(e, ">", builtin_gt);
+    lenv_add_builtin_argv(e, "<", builtin_lt);
+    lenv_add_builtin_argv(e, ">=", builtin_ge);
+    lenv_add_builtin_argv(e, "<=", builtin_le);
+    lenv_add_builtin_argv(e, "==", builtin_eq);
+    lenv_add_builtin_argv(e, "!=", builtin_ne);
+    lenv_add_form(e, "if", builtin_if, LFORM_IF);
+    lenv_add_builtin_argv(e, "!", builtin_not);
+    lenv_add_form(e, "||", builtin_or, LFORM_OR);
+    lenv_add_form(e, "&&", builtin_and, LFORM_AND);
 
     lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "save-image", builtin_save_image);
+    lenv_add_builtin(e, "load-image", builtin_load_image);
     lenv_add_builtin(e, "error", builtin_error);
     lenv_add_builtin(e, "print", builtin_print);
     lenv_add_builtin(e, "show", builtin_show);
@@ -763,28 +1209,50 @@ void lenv_add_builtins(lenv* e) {
 
 
 int main(int argc, char** argv) {
+#ifdef LZP_MPC_READER
     init_parser();
+#endif
 
     bool enable_prelude = true;
     bool shell = true;
+    char* image_in = NULL;
+    char* image_out = NULL;
 
     int opt; 
-    while((opt = getopt(argc, argv, "n")) != -1) {  
+    while((opt = getopt(argc, argv, "ns:i:o:")) != -1) {  
         switch(opt) {  
             case 'n': enable_prelude = false; break;
+            case 's': lvm_set_max_depth(atoi(optarg)); break;
+            case 'i': image_in = optarg; break;
+            case 'o': image_out = optarg; break;
         }  
     }  
 
-    if (optind < argc) {
+    if (optind < argc || image_out) {
         shell = false;
     }
 
 
     lenv* e = lenv_new();
+    lgc_add_root(e);
     lenv_add_builtins(e);
 
-    if (enable_prelude) {
+    if (image_in) {
+        lval* x = lenv_load_image_file(e, image_in);
+        if (x->type == LVAL_ERR) {
+            lval_println(e, x);
+        }
+        lval_del(x);
+    } else if (enable_prelude) {
+#ifdef LZP_PRELUDE_TEXT
         read_xxd(e, prelude_lzp, prelude_lzp_len);
+#else
+        lval* x = lenv_load_image(e, prelude_img, prelude_img_len);
+        if (x->type == LVAL_ERR) {
+            lval_println(e, x);
+        }
+        lval_del(x);
+#endif
     }
 
 
@@ -795,16 +1263,13 @@ int main(int argc, char** argv) {
             char* input = readline("lzp> ");
             add_history(input);
 
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lzp, &r)) {
-                lval* x = lval_eval(e, lval_read(r.output));
-                lval_println(e, x);
-                lval_del(x);
-                mpc_ast_delete(r.output);
-            } else {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+            lval* x = lval_read_src("<stdin>", input, strlen(input));
+            if (x->type != LVAL_ERR) {
+                x = lval_eval(e, x);
             }
+            lval_println(e, x);
+            lval_del(x);
+            lgc_maybe_collect();
 
             free(input);
         }
@@ -823,8 +1288,19 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (image_out) {
+        lval* x = lenv_save_image(e, image_out);
+        if (x->type == LVAL_ERR) {
+            lval_println(e, x);
+        }
+        lval_del(x);
+    }
+
     lenv_del(e);
+    lpool_release();
 
+#ifdef LZP_MPC_READER
     mpc_cleanup(9, Number, Float, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lzp);
+#endif
     return 0;
 }
@@ -6,6 +6,17 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <math.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 char* ltype_name(enum lval_type t) {
   switch(t) {
@@ -31,565 +42,4434 @@ mpc_parser_t* Qexpr;
 mpc_parser_t* Expr;
 mpc_parser_t* Lzp;
 
-// LVAL
+// POOL
 
-lval* lval_num(long long x) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->data.num = x;
-    return v;
+/*
+ * lval and lenv nodes are carved out of per-thread slabs, one pool per
+ * 16 byte size class. Freed nodes go onto the pool's free list and are
+ * handed out again LIFO, so freshly built expressions stay close together
+ * in memory. lpool_release() returns every slab of the thread at once.
+ */
+
+#define LPOOL_GRANULE 16
+#define LPOOL_CLASSES 8
+#define LPOOL_SLAB_SIZE (64 * 1024)
+
+typedef struct lslab {
+    struct lslab* next;
+} lslab;
+
+typedef struct lpool {
+    void* free;
+    char* bump;
+    char* end;
+    lslab* slabs;
+} lpool;
+
+static _Thread_local lpool lpools[LPOOL_CLASSES];
+
+void* lpool_alloc(size_t size) {
+    size_t cls = (size - 1) / LPOOL_GRANULE;
+    if (cls >= LPOOL_CLASSES) {
+        return malloc(size);
+    }
+
+    lpool* p = &lpools[cls];
+    if (p->free) {
+        void* x = p->free;
+        p->free = *(void**)x;
+        return x;
+    }
+
+    size_t block = (cls + 1) * LPOOL_GRANULE;
+    if (!p->bump || p->bump + block > p->end) {
+        lslab* s = malloc(LPOOL_SLAB_SIZE);
+        s->next = p->slabs;
+        p->slabs = s;
+        p->bump = (char*)s + LPOOL_GRANULE;
+        p->end = (char*)s + LPOOL_SLAB_SIZE;
+    }
+
+    void* x = p->bump;
+    p->bump += block;
+    return x;
 }
 
-lval* lval_flt(double x) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FLT;
-    v->data.flt = x;
-    return v;
+void lpool_free(void* x, size_t size) {
+    size_t cls = (size - 1) / LPOOL_GRANULE;
+    if (cls >= LPOOL_CLASSES) {
+        free(x);
+        return;
+    }
+
+    lpool* p = &lpools[cls];
+    *(void**)x = p->free;
+    p->free = x;
 }
 
-lval* lval_err(char* fmt, ...) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+void lpool_release(void) {
+    for (int i = 0; i < LPOOL_CLASSES; i++) {
+        lslab* s = lpools[i].slabs;
+        while (s) {
+            lslab* next = s->next;
+            free(s);
+            s = next;
+        }
+        memset(&lpools[i], 0, sizeof(lpool));
+    }
+}
 
-    va_list va;
-    va_start(va, fmt);
+static void lpool_each(size_t size, void (*fn)(void*)) {
+    size_t cls = (size - 1) / LPOOL_GRANULE;
+    size_t block = (cls + 1) * LPOOL_GRANULE;
+    lpool* p = &lpools[cls];
 
-    v->data.err = malloc(512);
+    for (lslab* s = p->slabs; s; s = s->next) {
+        char* x = (char*)s + LPOOL_GRANULE;
+        char* end = (char*)s + LPOOL_SLAB_SIZE;
+        if (s == p->slabs) {
+            end = p->bump;
+        }
+        for (; x + block <= end; x += block) {
+            fn(x);
+        }
+    }
+}
 
-    vsnprintf(v->data.err, 511, fmt, va);
-    v->data.err = realloc(v->data.err, strlen(v->data.err) + 1);
-    va_end(va);
-    return v;
+// GC
+
+/*
+ * Reference counts free almost every value as soon as it is dropped. The
+ * collector picks up what they cannot: cycles and nodes whose count was
+ * never released. It marks from the root environments and the root stack,
+ * then sweeps the lval and lenv pools. Collections only happen at safe
+ * points between top level forms, when no builtin is holding values on
+ * the C stack. LZP_GC_GROWTH sets how far the heap may grow past the live
+ * size of the last collection before the next one runs.
+ */
+
+#define LGC_LIVE 1
+#define LGC_PERM 2
+#define LGC_ROOT 4
+
+#define LGC_MIN_HEAP (1024 * 1024)
+#define LGC_GROWTH 2.0
+
+typedef struct lgc_state {
+    lenv** roots;
+    int root_count;
+
+    lval** stack;
+    int stack_count;
+    int stack_cap;
+
+    lval** gray;
+    int gray_count;
+    int gray_cap;
+
+    unsigned int epoch;
+    int depth;
+    double growth;
+    long long next;
+    lgc_stats stats;
+} lgc_state;
+
+static _Thread_local lgc_state lgc;
+
+static void lgc_account(long long bytes) {
+    lgc.stats.live_bytes += bytes;
+    if (lgc.stats.live_bytes > lgc.stats.peak_bytes) {
+        lgc.stats.peak_bytes = lgc.stats.live_bytes;
+    }
 }
 
-lval* lval_sym(char* s) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->data.sym = malloc(strlen(s) + 1);
-    strcpy(v->data.sym, s);
+static lval* lval_alloc(void) {
+    lval* v = lpool_alloc(sizeof(lval));
+    v->gc = LGC_LIVE;
+    v->mark = 0;
+    lgc_account(sizeof(lval));
     return v;
 }
 
-lval* lval_str(char* s) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->data.str = malloc(strlen(s) + 1);
-    strcpy(v->data.str, s);
-    return v;
+static void lval_free(lval* v) {
+    v->gc = 0;
+    lgc_account(-(long long)sizeof(lval));
+    lpool_free(v, sizeof(lval));
 }
 
-lval* lval_builtin(lbuiltin func) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->data.builtin = func;
-    return v;
+/*
+ * The cells of an expression live in a buffer that slices of it may
+ * share. The buffer holds one reference on every cell in [lo, hi); each
+ * expression sees the count cells starting at v->cell.
+ */
+typedef struct lcells {
+    int refs;
+    int lo;
+    int hi;
+    int cap;
+    struct lcode* code;
+    lval* cell[];
+} lcells;
+
+/*
+ * Inline cache of a global lookup, valid while version is lenv_version.
+ * The cache of the formals of a lambda form instead holds the lambda
+ * built from them, which the code owns.
+ */
+typedef struct lcache {
+    unsigned int version;
+    lval* val;
+} lcache;
+
+/*
+ * Bytecode compiled from the view cell[0..count) of a buffer. Constants
+ * are borrowed from the cells, which the buffer keeps alive. The buffer
+ * holds one reference and every frame running the code another.
+ */
+typedef struct lcode {
+    int refs;
+    lval** cell;
+    int count;
+    int* ops;
+    int op_count;
+    int op_cap;
+    lval** consts;
+    int const_count;
+    int const_cap;
+    lcache* caches;
+    int stack;
+    int nest;
+} lcode;
+
+static int lcode_owns(lcode* c, int i) {
+    return c->consts[i]->type != LVAL_SYM && c->caches[i].val;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+static void lcode_drop(lcode* c) {
+    if (c && --c->refs == 0) {
+        for (int i = 0; i < c->const_count; i++) {
+            if (lcode_owns(c, i)) {
+                lval_del(c->caches[i].val);
+            }
+        }
+        free(c->ops);
+        free(c->consts);
+        free(c->caches);
+        free(c);
+    }
+}
 
-    v->data.builtin = NULL;
-    v->env = lenv_new();
+/*
+ * Cache of a memoised function. Entries are keyed by the arguments of a
+ * call, chained in a hash table and kept in order of use, so the least
+ * recently used is evicted when the cache holds stats.max of them (no
+ * bound when it is 0). Shared by the copies of the function.
+ */
+typedef struct lmemo_entry {
+    unsigned int hash;
+    lval* args;
+    lval* val;
+    struct lmemo_entry* chain;
+    struct lmemo_entry* newer;
+    struct lmemo_entry* older;
+} lmemo_entry;
 
-    v->formals = formals;
-    v->body = body;
-    return v;
+typedef struct lmemo {
+    int refs;
+    lval* f;
+    lmemo_entry** table;
+    int cap;
+    lmemo_entry* newest;
+    lmemo_entry* oldest;
+    lmemo_stats stats;
+} lmemo;
+
+static void lmemo_free(lmemo* m, void (*drop)(lval*));
+
+static long long lcells_bytes(int cap) {
+    return sizeof(lcells) + sizeof(lval*) * (long long)cap;
 }
 
-lval* lval_sexpr(void) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+static lcells* lcells_new(int cap) {
+    lcells* b = malloc(lcells_bytes(cap));
+    lgc_account(lcells_bytes(cap));
+    b->refs = 1;
+    b->lo = 0;
+    b->hi = 0;
+    b->cap = cap;
+    b->code = NULL;
+    return b;
 }
 
-lval* lval_qexpr(void) {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+/*
+ * Called before the cells of an owned buffer are changed in place; any
+ * code compiled from them would be stale.
+ */
+static void lcells_touch(lcells* b) {
+    if (b->code) {
+        lcode_drop(b->code);
+        b->code = NULL;
+    }
 }
 
-void lval_del(lval* v) {
-    switch (v->type) {
-        case LVAL_NUM: break;
-        case LVAL_FLT: break;
-        case LVAL_FUN:
-            if (!v->data.builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
-            break;
-        case LVAL_ERR:
-            free(v->data.err); break;
-        case LVAL_SYM:
-            free(v->data.sym); break;
-        case LVAL_STR:
-            free(v->data.str); break;
-        
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-                lval_del(v->cell[i]);
-            }
+static void lcells_free(lcells* b) {
+    lgc_account(-lcells_bytes(b->cap));
+    free(b);
+}
 
-            free(v->cell);
-            break;
+static void lval_str_free(lval* v) {
+    if (v->data.str != v->chars) {
+        lgc_account(-(long long)v->size);
+        free(v->data.str);
     }
-    free(v);
 }
 
-lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+static void lval_err_free(lval* v) {
+    lgc_account(-(long long)(strlen(v->data.err) + 1));
+    free(v->data.err);
+}
 
-    switch (v->type) {
-        case LVAL_FUN:
-            if (v->data.builtin) {
-                x->data.builtin = v->data.builtin;
-            } else {
-                x->data.builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-            }
-            break;
-        case LVAL_NUM:
-            x->data.num = v->data.num; break;
-        case LVAL_FLT:
-            x->data.flt = v->data.flt; break;
+static lenv* lenv_alloc(void) {
+    lenv* e = lpool_alloc(sizeof(lenv));
+    e->gc = LGC_LIVE;
+    e->mark = 0;
+    lgc_account(sizeof(lenv));
+    return e;
+}
 
-        case LVAL_ERR:
-            x->data.err = malloc(strlen(v->data.err) + 1);
-            strcpy(x->data.err, v->data.err);
-            break;
-        case LVAL_SYM:
-            x->data.sym = malloc(strlen(v->data.sym) + 1);
-            strcpy(x->data.sym, v->data.sym);
-            break;
-        case LVAL_STR:
-            x->data.str = malloc(strlen(v->data.str) + 1);
-            strcpy(x->data.str, v->data.str);
-            break;
+/* The size of e with its bindings and index, for the collector's count. */
+static long long lenv_bytes(lenv* e) {
+    return sizeof(lenv) + (sizeof(char*) + sizeof(lval*)) * (long long)e->cap
+        + sizeof(int) * (long long)e->index_cap;
+}
 
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval *) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
-            break;
+static void lenv_free(lenv* e) {
+    e->gc = 0;
+    lgc_account(-lenv_bytes(e));
+    lpool_free(e, sizeof(lenv));
+}
+
+void lgc_add_root(lenv* e) {
+    if (!lgc.root_count) {
+        char* growth = getenv("LZP_GC_GROWTH");
+        lgc.growth = growth ? atof(growth) : LGC_GROWTH;
+        if (lgc.growth <= 1.0) {
+            lgc.growth = LGC_GROWTH;
+        }
+        lgc.next = LGC_MIN_HEAP;
     }
 
-    return x;
+    lgc.root_count++;
+    lgc.roots = realloc(lgc.roots, sizeof(lenv*) * lgc.root_count);
+    lgc.roots[lgc.root_count - 1] = e;
+    e->gc |= LGC_ROOT;
 }
 
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count - 1] = x;
-    return v;
+void lgc_push(lval* v) {
+    if (lgc.stack_count == lgc.stack_cap) {
+        lgc.stack_cap = lgc.stack_cap ? lgc.stack_cap * 2 : 16;
+        lgc.stack = realloc(lgc.stack, sizeof(lval*) * lgc.stack_cap);
+    }
+    lgc.stack[lgc.stack_count++] = v;
 }
 
-lval* lval_pop(lval* v, int i) {
-    lval* x = v->cell[i];
+void lgc_pop(int n) {
+    lgc.stack_count -= n;
+}
 
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
-    v->count--;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+static void lgc_gray(lval* v) {
+    if ((v->gc & LGC_PERM) || v->mark == lgc.epoch) {
+        return;
+    }
+    v->mark = lgc.epoch;
+
+    if (lgc.gray_count == lgc.gray_cap) {
+        lgc.gray_cap = lgc.gray_cap ? lgc.gray_cap * 2 : 256;
+        lgc.gray = realloc(lgc.gray, sizeof(lval*) * lgc.gray_cap);
+    }
+    lgc.gray[lgc.gray_count++] = v;
 }
 
-lval* lval_join(lval* x, lval* y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+static void lgc_mark_env(lenv* e) {
+    if (e->mark == lgc.epoch) {
+        return;
     }
+    e->mark = lgc.epoch;
 
-    lval_del(y);
-    return x;
+    for (int i = 0; i < e->count; i++) {
+        if (e->vals[i]) {
+            lgc_gray(e->vals[i]);
+        }
+    }
 }
 
-lval* lval_take(lval* v, int i) {
-    lval *x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+static void lgc_mark(void) {
+    for (int i = 0; i < lgc.root_count; i++) {
+        lgc_mark_env(lgc.roots[i]);
+    }
+    for (int i = 0; i < lgc.stack_count; i++) {
+        lgc_gray(lgc.stack[i]);
+    }
+
+    while (lgc.gray_count) {
+        lval* v = lgc.gray[--lgc.gray_count];
+        switch (v->type) {
+            case LVAL_FUN:
+                if (!v->data.builtin) {
+                    lgc_mark_env(v->env);
+                    lgc_gray(v->formals);
+                    lgc_gray(v->body);
+                } else if (v->memo) {
+                    lgc_gray(v->memo->f);
+                    for (lmemo_entry* x = v->memo->newest; x; x = x->older) {
+                        lgc_gray(x->args);
+                        lgc_gray(x->val);
+                    }
+                }
+                break;
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                if (v->buf) {
+                    for (int i = v->buf->lo; i < v->buf->hi; i++) {
+                        lgc_gray(v->buf->cell[i]);
+                    }
+                    lcode* c = v->buf->code;
+                    for (int i = 0; c && i < c->const_count; i++) {
+                        if (lcode_owns(c, i)) {
+                            lgc_gray(c->caches[i].val);
+                        }
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
 }
 
-int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) {
-        return 0;
+/*
+ * A garbage node gives back the references it holds on live nodes, but
+ * leaves other garbage alone: those are swept on their own.
+ */
+static void lgc_release(lval* v) {
+    if (v->mark == lgc.epoch) {
+        v->refs--;
     }
+}
 
-    switch (x->type) {
-        case LVAL_NUM:
-            return (x->data.num == y->data.num);
-        case LVAL_FLT:
-            return (fabs(x->data.flt - y->data.flt) < 0.000000000000001);
-        case LVAL_ERR:
-            return (strcmp(x->data.err, y->data.err) == 0);
-        case LVAL_SYM:
-            return (strcmp(x->data.sym, y->data.sym) == 0);
-        case LVAL_STR:
-            return (strcmp(x->data.str, y->data.str) == 0);
+static void lgc_sweep_val(void* x) {
+    lval* v = x;
+    if (!(v->gc & LGC_LIVE) || (v->gc & LGC_PERM) || v->mark == lgc.epoch) {
+        return;
+    }
 
+    switch (v->type) {
         case LVAL_FUN:
-            if (x->data.builtin || y->data.builtin) {
-                return x->data.builtin == y->data.builtin;
-            } 
-            return lval_eq(x->formals, y->formals)
-                && lval_eq(x->body, y->body);
-
+            if (!v->data.builtin) {
+                lgc_release(v->formals);
+                lgc_release(v->body);
+            } else if (v->memo && --v->memo->refs == 0) {
+                lmemo_free(v->memo, lgc_release);
+            }
+            break;
+        case LVAL_ERR:
+            lval_err_free(v); break;
+        case LVAL_STR:
+            lval_str_free(v); break;
         case LVAL_QEXPR:
         case LVAL_SEXPR:
-            if (x->count != y->count) {
-                return 0;
-            }
-
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[i], y->cell[i])) {
-                    return 0;
+            if (v->buf && --v->buf->refs == 0) {
+                for (int i = v->buf->lo; i < v->buf->hi; i++) {
+                    lgc_release(v->buf->cell[i]);
+                }
+                lcode* c = v->buf->code;
+                for (int i = 0; c && i < c->const_count; i++) {
+                    if (lcode_owns(c, i)) {
+                        lgc_release(c->caches[i].val);
+                        c->caches[i].val = NULL;
+                    }
                 }
+                lcode_drop(c);
+                lcells_free(v->buf);
             }
-            return 1;
-        break;
+            break;
+        default:
+            break;
     }
-    return 0;
+    lval_free(v);
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long long x = strtoll(t->contents, NULL, 10);
-    if (errno == ERANGE) {
-        return lval_err("invalid number");
+static void lenv_unbind(lenv* e);
+
+static void lgc_sweep_env(void* x) {
+    lenv* e = x;
+    if (!(e->gc & LGC_LIVE) || e->mark == lgc.epoch) {
+        return;
     }
-    return lval_num(x);
-}
 
-lval* lval_read_flt(mpc_ast_t* t) {
-    errno = 0;
-    double x = strtod(t->contents, NULL);
-    if (errno == ERANGE) {
-        return lval_err("invalid float");
+    lenv_unbind(e);
+    for (int i = 0; i < e->count; i++) {
+        if (e->vals[i]) {
+            lgc_release(e->vals[i]);
+        }
     }
-    return lval_flt(x);
+    free(e->syms);
+    free(e->vals);
+    free(e->index);
+    lenv_free(e);
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-    t->contents[strlen(t->contents) - 1] = '\0';
+void lgc_collect(void) {
+    if (!lgc.root_count) {
+        return;
+    }
 
-    char* unescaped = malloc(strlen(t->contents + 1) + 1);
-    strcpy(unescaped, t->contents + 1);
+    clock_t start = clock();
 
-    unescaped = mpcf_unescape(unescaped);
+    lgc.epoch++;
+    lgc_mark();
+    lpool_each(sizeof(lval), lgc_sweep_val);
+    lpool_each(sizeof(lenv), lgc_sweep_env);
 
-    lval* str = lval_str(unescaped);
-    free(unescaped);
-    return str;
-}
+    lgc.next = (long long)(lgc.stats.live_bytes * lgc.growth);
+    if (lgc.next < LGC_MIN_HEAP) {
+        lgc.next = LGC_MIN_HEAP;
+    }
 
-lval* lval_read(mpc_ast_t* t) {
-    if (strstr(t->tag, "number")) {
-        return lval_read_num(t);
+    double pause = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    lgc.stats.collections++;
+    lgc.stats.pause_total += pause;
+    if (pause > lgc.stats.pause_max) {
+        lgc.stats.pause_max = pause;
     }
-    if (strstr(t->tag, "float")) {
-        return lval_read_flt(t);
+}
+
+void lgc_maybe_collect(void) {
+    if (lgc.depth == 0 && lgc.stats.live_bytes >= lgc.next) {
+        lgc_collect();
     }
-    if (strstr(t->tag, "symbol")) {
-        return lval_sym(t->contents);
+}
+
+lgc_stats lgc_get_stats(void) {
+    return lgc.stats;
+}
+
+// SYMBOLS
+
+/*
+ * Every symbol name is interned once. lval_sym() hands out the single,
+ * never freed symbol value for a name, so symbols, environment keys and
+ * formals are compared by pointer and never by their characters. The
+ * name is stored after a count of the live bindings it has outside the
+ * root environments, see lvm_load().
+ */
+
+#define LSYM_INIT_CAP 256
+
+typedef struct lsym_name {
+    int bound;
+    char str[];
+} lsym_name;
+
+#define LSYM_NAME(s) ((lsym_name*)((s) - offsetof(lsym_name, str)))
+
+static lval** lsym_table;
+static int lsym_count;
+static int lsym_cap;
+static char* lsym_amp;
+
+static unsigned int lsym_hash(char* s, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
     }
-    if (strstr(t->tag, "string")) {
-        return lval_read_str(t);
+    return h;
+}
+
+static void lsym_insert(lval** table, int cap, lval* v) {
+    unsigned int i = lsym_hash(v->data.sym, strlen(v->data.sym)) & (cap - 1);
+    while (table[i]) {
+        i = (i + 1) & (cap - 1);
     }
+    table[i] = v;
+}
 
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) {
-        x = lval_sexpr();
+static void lsym_grow(void) {
+    int cap = lsym_cap ? lsym_cap * 2 : LSYM_INIT_CAP;
+    lval** table = calloc(cap, sizeof(lval*));
+    for (int i = 0; i < lsym_cap; i++) {
+        if (lsym_table[i]) {
+            lsym_insert(table, cap, lsym_table[i]);
+        }
     }
-    if (strstr(t->tag, "sexpr")) {
-        x = lval_sexpr();
+
+    free(lsym_table);
+    lsym_table = table;
+    lsym_cap = cap;
+
+    if (!lsym_amp) {
+        lsym_amp = lval_sym("&")->data.sym;
     }
-    if (strstr(t->tag, "qexpr")) {
-        x = lval_qexpr();
+}
+
+/*
+ * Interns the len characters at s, which need not be NUL terminated, so
+ * the reader can look names up straight from the source text.
+ */
+lval* lval_symn(char* s, int len) {
+    if ((lsym_count + 1) * 2 > lsym_cap) {
+        lsym_grow();
     }
 
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        if (strstr(t->children[i]->tag, "comment")) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
+    unsigned int i = lsym_hash(s, len) & (lsym_cap - 1);
+    while (lsym_table[i]) {
+        char* name = lsym_table[i]->data.sym;
+        if (strncmp(name, s, len) == 0 && name[len] == '\0') {
+            return lsym_table[i];
+        }
+        i = (i + 1) & (lsym_cap - 1);
+    }
+
+    lval* v = calloc(1, sizeof(lval));
+    v->type = LVAL_SYM;
+    v->refs = 1;
+    v->gc = LGC_PERM;
+    v->slot = -1;
+    lsym_name* name = malloc(sizeof(lsym_name) + len + 1);
+    name->bound = 0;
+    memcpy(name->str, s, len);
+    name->str[len] = '\0';
+    v->data.sym = name->str;
+
+    lsym_table[i] = v;
+    lsym_count++;
+    return v;
+}
+
+lval* lval_sym(char* s) {
+    return lval_symn(s, strlen(s));
+}
+
+// LVAL
+
+static int lval_owns_cells(lval* v);
+static void lcells_release(lcells* b);
+static void lval_own_cells(lval* v, lval* src, int front, int back);
+
+/*
+ * Small integers are preallocated and never freed, like symbols, so the
+ * counters, indices, booleans and literals that make up most arithmetic
+ * never touch the pool. Every type keeps only the fields it uses: the
+ * function and expression fields of an lval share storage.
+ */
+
+#define LNUM_CACHE_MIN -128
+#define LNUM_CACHE_MAX 1023
+
+static lval lnum_cache[LNUM_CACHE_MAX - LNUM_CACHE_MIN + 1];
+
+lval* lval_num(long long x) {
+    if (x >= LNUM_CACHE_MIN && x <= LNUM_CACHE_MAX) {
+        lval* v = &lnum_cache[x - LNUM_CACHE_MIN];
+        if (!v->gc) {
+            v->type = LVAL_NUM;
+            v->refs = 1;
+            v->gc = LGC_PERM;
+            v->data.num = x;
+        }
+        return v;
+    }
+
+    lval *v = lval_alloc();
+    v->type = LVAL_NUM;
+    v->refs = 1;
+    v->data.num = x;
+    return v;
+}
+
+lval* lval_flt(double x) {
+    lval *v = lval_alloc();
+    v->type = LVAL_FLT;
+    v->refs = 1;
+    v->data.flt = x;
+    return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+    lval *v = lval_alloc();
+    v->type = LVAL_ERR;
+    v->refs = 1;
+
+    va_list va;
+    va_start(va, fmt);
+
+    v->data.err = malloc(512);
+
+    vsnprintf(v->data.err, 511, fmt, va);
+    v->data.err = realloc(v->data.err, strlen(v->data.err) + 1);
+    lgc_account(strlen(v->data.err) + 1);
+    va_end(va);
+    return v;
+}
+
+/*
+ * Strings know their length. Up to 15 characters are kept in the value
+ * itself; longer ones live in a separate buffer of v->size bytes that
+ * grows geometrically as strings are joined onto it. data.str always
+ * points at the NUL terminated characters, wherever they are.
+ */
+static void lval_str_set(lval* v, char* s, int len) {
+    v->len = len;
+    if (len < (int)sizeof(v->chars)) {
+        v->data.str = v->chars;
+        v->size = sizeof(v->chars);
+    } else {
+        v->size = len + 1;
+        v->data.str = malloc(v->size);
+        lgc_account(v->size);
+    }
+    memcpy(v->data.str, s, len);
+    v->data.str[len] = '\0';
+}
+
+lval* lval_strn(char* s, int len) {
+    lval *v = lval_alloc();
+    v->type = LVAL_STR;
+    v->refs = 1;
+    lval_str_set(v, s, len);
+    return v;
+}
+
+lval* lval_str(char* s) {
+    return lval_strn(s, strlen(s));
+}
+
+lval* lval_builtin(lbuiltin func) {
+    lval *v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->refs = 1;
+    v->argv = 0;
+    v->form = LFORM_NONE;
+    v->memo = NULL;
+    v->data.builtin = func;
+    return v;
+}
+
+lval* lval_builtin_argv(lbuiltin_argv func) {
+    lval *v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->refs = 1;
+    v->argv = 1;
+    v->form = LFORM_NONE;
+    v->memo = NULL;
+    v->data.builtin_argv = func;
+    return v;
+}
+
+/*
+ * A stack of values for walking nested lists without recursing on the C
+ * stack, which values built at run time can nest deeper than it holds.
+ * It starts out in small and moves to the heap once that is full.
+ */
+#define LWALK_SMALL 32
+
+typedef struct lwalk {
+    lval** vals;
+    int count;
+    int cap;
+    lval* small[LWALK_SMALL];
+} lwalk;
+
+static void lwalk_init(lwalk* w) {
+    w->vals = w->small;
+    w->count = 0;
+    w->cap = LWALK_SMALL;
+}
+
+static void lwalk_push(lwalk* w, lval* v) {
+    if (w->count == w->cap) {
+        w->cap *= 2;
+        if (w->vals == w->small) {
+            w->vals = malloc(sizeof(lval*) * w->cap);
+            memcpy(w->vals, w->small, sizeof(w->small));
+        } else {
+            w->vals = realloc(w->vals, sizeof(lval*) * w->cap);
+        }
+    }
+    w->vals[w->count++] = v;
+}
+
+static lval* lwalk_pop(lwalk* w) {
+    return w->vals[--w->count];
+}
+
+static void lwalk_free(lwalk* w) {
+    if (w->vals != w->small) {
+        free(w->vals);
+    }
+}
+
+/* Pushes the cells of v last to first, so they are popped in order. */
+static void lwalk_push_cells(lwalk* w, lval* v) {
+    for (int i = v->count - 1; i >= 0; i--) {
+        lwalk_push(w, v->cell[i]);
+    }
+}
+
+/*
+ * Resolution pass, run once when a lambda is built. Every name the
+ * function binds in its own frame (its formals and the targets of '='
+ * forms in its body) is given a slot, and v->env becomes a frame template
+ * holding those names in slot order. References to them in the body are
+ * replaced by symbol nodes carrying the slot, so evaluating a local is an
+ * indexed load. Frames chain to the caller, not to the defining scope,
+ * so any other name is still looked up by name at run time.
+ */
+static int lenv_find(lenv* e, char* sym);
+
+static void lenv_add_slot(lenv* e, char* sym) {
+    if (lenv_find(e, sym) != -1) {
+        return;
+    }
+
+    lval* k = lval_sym(sym);
+    lenv_put(e, k, NULL);
+}
+
+/* Visits the lists in v in the order recursing on them would. */
+static void lval_collect_slots(lenv* frame, lval* v, char* put) {
+    lwalk w;
+    lwalk_init(&w);
+    lwalk_push(&w, v);
+
+    while (w.count) {
+        v = lwalk_pop(&w);
+        if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+            continue;
+        }
+
+        if (v->count >= 2 && v->cell[0]->type == LVAL_SYM
+            && v->cell[0]->data.sym == put && v->cell[1]->type == LVAL_QEXPR) {
+            lval* syms = v->cell[1];
+            for (int i = 0; i < syms->count; i++) {
+                if (syms->cell[i]->type == LVAL_SYM) {
+                    lenv_add_slot(frame, syms->cell[i]->data.sym);
+                }
+            }
+        }
+        lwalk_push_cells(&w, v);
+    }
+    lwalk_free(&w);
+}
+
+static lval* lval_resolve_atom(lenv* frame, lval* v) {
+    if (v->type != LVAL_SYM) {
+        return lval_copy(v);
+    }
+
+    int i = lenv_find(frame, v->data.sym);
+    if (i == -1) {
+        return lval_sym(v->data.sym);
+    }
+
+    lval* x = lval_alloc();
+    x->type = LVAL_SYM;
+    x->refs = 1;
+    x->data.sym = v->data.sym;
+    x->slot = i;
+    return x;
+}
+
+/*
+ * Copies v with its locals resolved. The lists being copied are kept in
+ * open, each with the copy built so far, the way lreader_next() keeps
+ * the lists it is reading.
+ */
+static lval* lval_resolve(lenv* frame, lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return lval_resolve_atom(frame, v);
+    }
+
+    lwalk open;
+    lwalk_init(&open);
+    lwalk_push(&open, v);
+    lwalk_push(&open, v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr());
+
+    while (1) {
+        lval* src = open.vals[open.count - 2];
+        lval* x = open.vals[open.count - 1];
+        if (x->count < src->count) {
+            lval* c = src->cell[x->count];
+            if (c->type == LVAL_SEXPR || c->type == LVAL_QEXPR) {
+                lwalk_push(&open, c);
+                lwalk_push(&open, c->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr());
+            } else {
+                open.vals[open.count - 1] = lval_add(x, lval_resolve_atom(frame, c));
+            }
+            continue;
+        }
+
+        open.count -= 2;
+        if (open.count == 0) {
+            lwalk_free(&open);
+            return x;
+        }
+        open.vals[open.count - 1] = lval_add(open.vals[open.count - 1], x);
+    }
+}
+
+lval* lval_lambda(lval* formals, lval* body) {
+    lval *v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->refs = 1;
+
+    v->data.builtin = NULL;
+    v->env = lenv_new();
+
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->data.sym != lsym_amp) {
+            lenv_add_slot(v->env, formals->cell[i]->data.sym);
+        }
+    }
+    lval_collect_slots(v->env, body, lval_sym("=")->data.sym);
+
+    v->formals = formals;
+    v->body = lval_resolve(v->env, body);
+    lval_del(body);
+    return v;
+}
+
+lval* lval_sexpr(void) {
+    lval *v = lval_alloc();
+    v->type = LVAL_SEXPR;
+    v->refs = 1;
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    return v;
+}
+
+lval* lval_qexpr(void) {
+    lval *v = lval_alloc();
+    v->type = LVAL_QEXPR;
+    v->refs = 1;
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    return v;
+}
+
+/*
+ * Freeing a value drops the references it holds, which may free more.
+ * Recursing on those would overflow the C stack on a long enough chain of
+ * nested lists, so values dropped to zero while another is being freed
+ * wait on a stack instead and are freed in turn.
+ */
+typedef struct ldel_state {
+    lval** stack;
+    int count;
+    int cap;
+    int busy;
+} ldel_state;
+
+static _Thread_local ldel_state ldel;
+
+static void lval_destroy(lval* v);
+
+void lval_del(lval* v) {
+    if ((v->gc & LGC_PERM) || --v->refs > 0) {
+        return;
+    }
+    if (v->type == LVAL_NUM || v->type == LVAL_FLT) {
+        lval_free(v);
+        return;
+    }
+
+    if (ldel.busy) {
+        if (ldel.count == ldel.cap) {
+            ldel.cap = ldel.cap ? ldel.cap * 2 : 256;
+            ldel.stack = realloc(ldel.stack, sizeof(lval*) * ldel.cap);
+        }
+        ldel.stack[ldel.count++] = v;
+        return;
+    }
+
+    ldel.busy = 1;
+    lval_destroy(v);
+    while (ldel.count) {
+        lval_destroy(ldel.stack[--ldel.count]);
+    }
+    ldel.busy = 0;
+}
+
+static void lval_destroy(lval* v) {
+    switch (v->type) {
+        case LVAL_NUM: break;
+        case LVAL_FLT: break;
+        case LVAL_FUN:
+            if (!v->data.builtin) {
+                lenv_del(v->env);
+                lval_del(v->formals);
+                lval_del(v->body);
+            } else if (v->memo && --v->memo->refs == 0) {
+                lmemo_free(v->memo, lval_del);
+            }
+            break;
+        case LVAL_ERR:
+            lval_err_free(v); break;
+        case LVAL_SYM: break;
+        case LVAL_STR:
+            lval_str_free(v); break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            lcells_release(v->buf);
+            break;
+    }
+    lval_free(v);
+}
+
+/*
+ * Values are immutable once shared, so taking another reference is just a
+ * count increment. Code that wants to modify a value must go through
+ * lval_unshare() first.
+ */
+lval* lval_copy(lval* v) {
+    if (!(v->gc & LGC_PERM)) {
+        v->refs++;
+    }
+    return v;
+}
+
+/*
+ * Returns a version of v that the caller may modify in place. A value with
+ * a single owner is returned as is; a shared one is copied one level deep
+ * (children are shared with the original) and the reference to the
+ * original is dropped.
+ */
+lval* lval_unshare(lval* v) {
+    if (v->refs == 1 && !(v->gc & LGC_PERM)) {
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->buf) {
+            if (lval_owns_cells(v)) {
+                lcells_touch(v->buf);
+            } else {
+                lval_own_cells(v, v, 0, 0);
+            }
+        }
+        return v;
+    }
+
+    lval* x = lval_alloc();
+    x->type = v->type;
+    x->refs = 1;
+
+    switch (v->type) {
+        case LVAL_FUN:
+            if (v->data.builtin) {
+                x->argv = v->argv;
+                x->form = v->form;
+                x->data.builtin = v->data.builtin;
+                x->memo = v->memo;
+                if (x->memo) {
+                    x->memo->refs++;
+                }
+            } else {
+                x->data.builtin = NULL;
+                x->env = lenv_copy(v->env);
+                x->formals = lval_unshare(lval_copy(v->formals));
+                x->body = lval_copy(v->body);
+            }
+            break;
+        case LVAL_NUM:
+            x->data.num = v->data.num; break;
+        case LVAL_FLT:
+            x->data.flt = v->data.flt; break;
+
+        case LVAL_ERR:
+            x->data.err = malloc(strlen(v->data.err) + 1);
+            strcpy(x->data.err, v->data.err);
+            lgc_account(strlen(x->data.err) + 1);
+            break;
+        case LVAL_SYM:
+            x->data.sym = v->data.sym;
+            x->slot = v->slot;
+            break;
+        case LVAL_STR:
+            lval_str_set(x, v->data.str, v->len);
+            break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            x->count = 0;
+            x->cell = NULL;
+            x->buf = NULL;
+            lval_own_cells(x, v, 0, 0);
+            break;
     }
 
+    lval_del(v);
     return x;
 }
 
-void lval_expr_print(lenv* e, lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(e, v->cell[i]);
-
-        if (i != (v->count-1)) {
-            putchar(' ');
+/*
+ * Expression cells live in a buffer with spare capacity on both ends.
+ * Appending grows the buffer geometrically, popping the first cell just
+ * moves v->cell forward, and making room at the front leaves the new
+ * slack there, so building a list from either end is amortised O(1).
+ * Before cells are changed in place the expression must be the only
+ * user of its buffer; lval_own_cells() gives it a private one when a
+ * slice still shares it.
+ */
+/*
+ * True when v is the only user of its buffer and sees all of it, so its
+ * cells may be changed in place.
+ */
+static int lval_owns_cells(lval* v) {
+    lcells* b = v->buf;
+    return b->refs == 1 && v->cell == b->cell + b->lo && b->hi == b->lo + v->count;
+}
+
+static void lcells_release(lcells* b) {
+    if (!b || --b->refs > 0) {
+        return;
+    }
+    for (int i = b->lo; i < b->hi; i++) {
+        lval_del(b->cell[i]);
+    }
+    lcode_drop(b->code);
+    lcells_free(b);
+}
+
+/*
+ * Rebuilds v's cells from the view of src in a private buffer with room
+ * for front and back more cells. src may be v itself. Cells still owned
+ * by another user of the old buffer are counted again; cells nobody sees
+ * any more are dropped with it.
+ */
+static void lval_own_cells(lval* v, lval* src, int front, int back) {
+    int count = src->count;
+    lcells* old = src->buf;
+
+    int cap = (count + front + back) * 2;
+    if (cap < 4) {
+        cap = 4;
+    }
+
+    if (v == src && old && lval_owns_cells(v) && old->lo == 0 && !front) {
+        lgc_account(lcells_bytes(cap) - lcells_bytes(old->cap));
+        old = realloc(old, lcells_bytes(cap));
+        old->cap = cap;
+        v->buf = old;
+        v->cell = old->cell;
+        return;
+    }
+
+    lcells* b = lcells_new(cap);
+    b->lo = front ? cap - count - back : 0;
+    b->hi = b->lo + count;
+    for (int i = 0; i < count; i++) {
+        b->cell[b->lo + i] = lval_copy(src->cell[i]);
+    }
+
+    v->cell = b->cell + b->lo;
+    v->buf = b;
+    v->count = count;
+    if (v == src) {
+        lcells_release(old);
+    }
+}
+
+static void lval_reserve(lval* v, int front, int back) {
+    lcells* b = v->buf;
+    if (b && lval_owns_cells(v)) {
+        lcells_touch(b);
+        if (b->lo >= front && b->cap - b->hi >= back) {
+            return;
+        }
+    }
+    lval_own_cells(v, v, front, back);
+}
+
+lval* lval_add(lval* v, lval* x) {
+    lval_reserve(v, 0, 1);
+    v->cell[v->count++] = x;
+    v->buf->hi++;
+    return v;
+}
+
+lval* lval_pop(lval* v, int i) {
+    lval_reserve(v, 0, 0);
+    lval* x = v->cell[i];
+
+    if (i == 0) {
+        v->cell++;
+        v->buf->lo++;
+    } else {
+        memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
+        v->buf->hi--;
+    }
+    v->count--;
+    return x;
+}
+
+/*
+ * Moves the cells of src into dst. A source nobody else holds gives up
+ * its references; a shared one keeps them and each cell is counted again.
+ */
+static void lval_move_cells(lval** dst, lval* src) {
+    if (!src->count) {
+        return;
+    }
+    if (src->refs == 1) {
+        lval_reserve(src, 0, 0);
+        memcpy(dst, src->cell, sizeof(lval*) * src->count);
+        src->buf->hi = src->buf->lo;
+        src->count = 0;
+        return;
+    }
+    for (int i = 0; i < src->count; i++) {
+        dst[i] = lval_copy(src->cell[i]);
+    }
+}
+
+lval* lval_join(lval* x, lval* y) {
+    if (y->refs == 1 && x->count < y->count) {
+        int n = x->count;
+        lval_reserve(y, n, 0);
+        y->cell -= n;
+        y->buf->lo -= n;
+        y->count += n;
+        y->type = x->type;
+        lval_move_cells(y->cell, x);
+
+        lval_del(x);
+        return y;
+    }
+
+    int n = y->count;
+    x = lval_unshare(x);
+    lval_reserve(x, 0, n);
+    lval_move_cells(x->cell + x->count, y);
+    x->count += n;
+    x->buf->hi += n;
+
+    lval_del(y);
+    return x;
+}
+
+lval* lval_str_join(lval* x, lval* y) {
+    x = lval_unshare(x);
+
+    int len = x->len + y->len;
+    if (len + 1 > x->size) {
+        int size = (len + 1) * 2;
+        if (x->data.str == x->chars) {
+            char* s = malloc(size);
+            memcpy(s, x->chars, x->len + 1);
+            x->data.str = s;
+            lgc_account(size);
+        } else {
+            x->data.str = realloc(x->data.str, size);
+            lgc_account(size - x->size);
+        }
+        x->size = size;
+    }
+
+    memcpy(x->data.str + x->len, y->data.str, y->len + 1);
+    x->len = len;
+
+    lval_del(y);
+    return x;
+}
+
+/*
+ * Returns the count cells of v starting at start. A shared v is not
+ * copied: the slice is a new expression that views the same buffer.
+ */
+lval* lval_slice(lval* v, int start, int count) {
+    if (v->refs == 1 && v->buf && lval_owns_cells(v)) {
+        lcells_touch(v->buf);
+        for (int i = 0; i < v->count; i++) {
+            if (i < start || i >= start + count) {
+                lval_del(v->cell[i]);
+            }
+        }
+        v->cell += start;
+        v->buf->lo += start;
+        v->buf->hi = v->buf->lo + count;
+        v->count = count;
+        return v;
+    }
+
+    if (v->refs == 1) {
+        v->cell += start;
+        v->count = count;
+        return v;
+    }
+
+    lval* x = lval_alloc();
+    x->type = v->type;
+    x->refs = 1;
+    x->cell = v->cell + start;
+    x->count = count;
+    x->buf = v->buf;
+    if (x->buf) {
+        x->buf->refs++;
+    }
+
+    lval_del(v);
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    if (v->refs > 1 || !lval_owns_cells(v)) {
+        lval* x = lval_copy(v->cell[i]);
+        lval_del(v);
+        return x;
+    }
+
+    lval *x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+/*
+ * Takes argument i out of the vector of a builtin, which the caller then
+ * no longer deletes.
+ */
+lval* lval_take_arg(lval** argv, int i) {
+    lval* x = argv[i];
+    argv[i] = NULL;
+    return x;
+}
+
+/*
+ * Lambdas with the same formals and body also have the same template, but
+ * partial application fills in some of its values: (add 1) and (add 2)
+ * differ only there.
+ */
+static int lenv_eq_vals(lwalk* w, lenv* x, lenv* y) {
+    if (x->count != y->count) {
+        return 0;
+    }
+    for (int i = 0; i < x->count; i++) {
+        if (x->syms[i] != y->syms[i] || !x->vals[i] != !y->vals[i]) {
+            return 0;
+        }
+        if (x->vals[i]) {
+            lwalk_push(w, x->vals[i]);
+            lwalk_push(w, y->vals[i]);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Compares x and y themselves, leaving the pairs of values they hold on
+ * w to be compared in turn.
+ */
+static int lval_eq_step(lwalk* w, lval* x, lval* y) {
+    if (x->type != y->type) {
+        return 0;
+    }
+
+    switch (x->type) {
+        case LVAL_NUM:
+            return (x->data.num == y->data.num);
+        case LVAL_FLT:
+            return (fabs(x->data.flt - y->data.flt) < 0.000000000000001);
+        case LVAL_ERR:
+            return (strcmp(x->data.err, y->data.err) == 0);
+        case LVAL_SYM:
+            return x->data.sym == y->data.sym;
+        case LVAL_STR:
+            return x->len == y->len
+                && memcmp(x->data.str, y->data.str, x->len) == 0;
+
+        case LVAL_FUN:
+            if (x->data.builtin || y->data.builtin) {
+                return x->data.builtin == y->data.builtin && x->memo == y->memo;
+            }
+            lwalk_push(w, x->formals);
+            lwalk_push(w, y->formals);
+            lwalk_push(w, x->body);
+            lwalk_push(w, y->body);
+            return lenv_eq_vals(w, x->env, y->env);
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (x->count != y->count) {
+                return 0;
+            }
+
+            for (int i = x->count - 1; i >= 0; i--) {
+                lwalk_push(w, x->cell[i]);
+                lwalk_push(w, y->cell[i]);
+            }
+            return 1;
+        break;
+    }
+    return 0;
+}
+
+int lval_eq(lval* x, lval* y) {
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR && x->type != LVAL_FUN) {
+        return lval_eq_step(NULL, x, y);
+    }
+
+    lwalk w;
+    lwalk_init(&w);
+    lwalk_push(&w, x);
+    lwalk_push(&w, y);
+
+    int eq = 1;
+    while (eq && w.count) {
+        y = lwalk_pop(&w);
+        x = lwalk_pop(&w);
+        eq = lval_eq_step(&w, x, y);
+    }
+    lwalk_free(&w);
+    return eq;
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long long x = strtoll(t->contents, NULL, 10);
+    if (errno == ERANGE) {
+        return lval_err("invalid number");
+    }
+    return lval_num(x);
+}
+
+lval* lval_read_flt(mpc_ast_t* t) {
+    errno = 0;
+    double x = strtod(t->contents, NULL);
+    if (errno == ERANGE) {
+        return lval_err("invalid float");
+    }
+    return lval_flt(x);
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+    t->contents[strlen(t->contents) - 1] = '\0';
+
+    char* unescaped = malloc(strlen(t->contents + 1) + 1);
+    strcpy(unescaped, t->contents + 1);
+
+    unescaped = mpcf_unescape(unescaped);
+
+    lval* str = lval_str(unescaped);
+    free(unescaped);
+    return str;
+}
+
+lval* lval_read(mpc_ast_t* t) {
+    if (strstr(t->tag, "number")) {
+        return lval_read_num(t);
+    }
+    if (strstr(t->tag, "float")) {
+        return lval_read_flt(t);
+    }
+    if (strstr(t->tag, "symbol")) {
+        return lval_sym(t->contents);
+    }
+    if (strstr(t->tag, "string")) {
+        return lval_read_str(t);
+    }
+
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) {
+        x = lval_sexpr();
+    }
+    if (strstr(t->tag, "sexpr")) {
+        x = lval_sexpr();
+    }
+    if (strstr(t->tag, "qexpr")) {
+        x = lval_qexpr();
+    }
+
+    for (int i = 0; i < t->children_num; i++) {
+        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+        if (strstr(t->children[i]->tag, "comment")) { continue; }
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+
+    return x;
+}
+
+/*
+ * Values are written into a buffer that grows as needed. What is left to
+ * write of the lists and lambdas being written waits on a stack, so
+ * nesting does not recurse: each entry is a value, or when v is NULL the
+ * character c.
+ */
+typedef struct lprint_item {
+    lval* v;
+    char c;
+} lprint_item;
+
+typedef struct lprinter {
+    char* buf;
+    long len;
+    long cap;
+    lprint_item* stack;
+    int count;
+    int stack_cap;
+} lprinter;
+
+static void lprint_put(lprinter* p, const char* s, long len) {
+    if (p->len + len + 1 > p->cap) {
+        p->cap = (p->len + len + 1) * 2;
+        p->buf = realloc(p->buf, p->cap);
+    }
+    memcpy(p->buf + p->len, s, len);
+    p->len += len;
+    p->buf[p->len] = '\0';
+}
+
+static void lprint_puts(lprinter* p, const char* s) {
+    lprint_put(p, s, strlen(s));
+}
+
+static void lprint_push(lprinter* p, lval* v, char c) {
+    if (p->count == p->stack_cap) {
+        p->stack_cap = p->stack_cap ? p->stack_cap * 2 : 64;
+        p->stack = realloc(p->stack, sizeof(lprint_item) * p->stack_cap);
+    }
+    p->stack[p->count].v = v;
+    p->stack[p->count].c = c;
+    p->count++;
+}
+
+/* Writes open and leaves the cells of v, spaced, and close to write. */
+static void lprint_expr(lprinter* p, lval* v, char open, char close) {
+    lprint_put(p, &open, 1);
+    lprint_push(p, NULL, close);
+    for (int i = v->count - 1; i >= 0; i--) {
+        lprint_push(p, v->cell[i], 0);
+        if (i) {
+            lprint_push(p, NULL, ' ');
+        }
+    }
+}
+
+static void lprint_val(lprinter* p, lenv* e, lval* v) {
+    char temp[64];
+
+    switch (v->type) {
+        case LVAL_NUM:
+            snprintf(temp, sizeof(temp), "%lli", v->data.num);
+            lprint_puts(p, temp);
+            break;
+        case LVAL_FLT:
+            snprintf(temp, sizeof(temp), "%.15g", v->data.flt);
+            lprint_puts(p, temp);
+            break;
+        case LVAL_ERR:
+            lprint_puts(p, "Error: ");
+            lprint_puts(p, v->data.err);
+            break;
+        case LVAL_SYM:
+            lprint_puts(p, v->data.sym);
+            break;
+        case LVAL_STR:
+            lprint_puts(p, "\"");
+            lprint_puts(p, v->data.str);
+            lprint_puts(p, "\"");
+            break;
+        case LVAL_FUN:
+            if (v->data.builtin && v->memo) {
+                lprint_puts(p, "<memo ");
+                lprint_push(p, NULL, '>');
+                lprint_push(p, v->memo->f, 0);
+            } else if (v->data.builtin) {
+                lval* x = lenv_fetch_symbol(e, v);
+                lprint_puts(p, "<");
+                lprint_puts(p, x->data.sym);
+                lprint_puts(p, ">");
+                lval_del(x);
+            } else {
+                lprint_puts(p, "(\\ ");
+                lprint_push(p, NULL, ')');
+                lprint_push(p, v->body, 0);
+                lprint_push(p, NULL, ' ');
+                lprint_push(p, v->formals, 0);
+            }
+            break;
+        case LVAL_SEXPR:
+            lprint_expr(p, v, '(', ')');
+            break;
+        case LVAL_QEXPR:
+            lprint_expr(p, v, '{', '}');
+            break;
+    }
+}
+
+/* Writes what is left on the stack and returns the string. */
+static char* lprint_finish(lprinter* p, lenv* e) {
+    while (p->count) {
+        lprint_item it = p->stack[--p->count];
+        if (it.v) {
+            lprint_val(p, e, it.v);
+        } else {
+            lprint_put(p, &it.c, 1);
+        }
+    }
+    free(p->stack);
+    if (!p->buf) {
+        lprint_put(p, "", 0);
+    }
+    return p->buf;
+}
+
+void lval_expr_print(lenv* e, lval* v, char open, char close) {
+    char* str = lval_expr_to_string(e, v, open, close);
+    fputs(str, stdout);
+    free(str);
+}
+
+char* lval_expr_to_string(lenv* e, lval* v, char open, char close) {
+    lprinter p = {0};
+    lprint_expr(&p, v, open, close);
+    return lprint_finish(&p, e);
+}
+
+void lval_print(lenv* e, lval* v) {
+    char* str = lval_string(e, v);
+    printf("%s", str);
+    free(str);
+}
+
+char* lval_string(lenv* e, lval* v) {
+    lprinter p = {0};
+    lprint_val(&p, e, v);
+    return lprint_finish(&p, e);
+}
+
+void lval_println(lenv* e, lval* v) {
+    lval_print(e, v);
+    putchar('\n');
+}
+
+// READER
+
+/*
+ * A scanner for the grammar in init_parser() that builds lvals as it
+ * goes. Tokens are matched the way the grammar orders its alternatives:
+ * a float, else a number, else a symbol, each as long as it can be, so
+ * "12abc" is still the number 12 followed by the symbol abc. Lines and
+ * columns are only counted when there is an error to report.
+ */
+
+#define LREAD_TOKEN_MAX 64
+
+static int lread_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int lread_symbol_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lread_digit(c)
+        || strchr("_+-*/\\=<>%!&|", c) != NULL;
+}
+
+static lval* lread_err(lreader* r, char* at, char* fmt, ...) {
+    int line = 1;
+    char* bol = r->src;
+    for (char* p = r->src; p < at; p++) {
+        if (*p == '\n') {
+            line++;
+            bol = p + 1;
+        }
+    }
+
+    char msg[256];
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, va);
+    va_end(va);
+
+    r->cur = r->end;
+    r->failed = 1;
+    return lval_err("%s:%d:%ld: error: %s", r->name, line, (long)(at - bol) + 1, msg);
+}
+
+static void lread_space(lreader* r) {
+    while (r->cur < r->end) {
+        char c = *r->cur;
+        if (c == ';') {
+            while (r->cur < r->end && *r->cur != '\n' && *r->cur != '\r') {
+                r->cur++;
+            }
+        } else if (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            r->cur++;
+        } else {
+            return;
+        }
+    }
+}
+
+/* Numbers are converted from a terminated copy so strtod stops where the token does. */
+static lval* lread_number(char* s, int len, int flt) {
+    char small[LREAD_TOKEN_MAX];
+    char* buf = len < LREAD_TOKEN_MAX ? small : malloc(len + 1);
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    lval* x;
+    errno = 0;
+    if (flt) {
+        double d = strtod(buf, NULL);
+        x = errno == ERANGE ? lval_err("invalid float") : lval_flt(d);
+    } else {
+        long long n = strtoll(buf, NULL, 10);
+        x = errno == ERANGE ? lval_err("invalid number") : lval_num(n);
+    }
+
+    if (buf != small) {
+        free(buf);
+    }
+    return x;
+}
+
+static const char lread_escapes[] = "abfnrtv\\'\"0";
+static const char lread_escaped[] = "\a\b\f\n\r\t\v\\'\"";
+
+static lval* lread_string(lreader* r) {
+    char* start = r->cur;
+    char* p = start + 1;
+    int escapes = 0;
+    while (p < r->end && *p != '"') {
+        if (*p == '\\') {
+            if (++p == r->end) {
+                break;
+            }
+            escapes = 1;
+        }
+        p++;
+    }
+    if (p == r->end) {
+        return lread_err(r, start, "unterminated string");
+    }
+    r->cur = p + 1;
+
+    char* s = start + 1;
+    int len = p - s;
+    if (!escapes) {
+        return lval_strn(s, len);
+    }
+
+    /* Unknown escapes are kept as they are and \0 is dropped, like mpcf_unescape(). */
+    char* buf = malloc(len + 1);
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        char* esc = s[i] == '\\' ? strchr(lread_escapes, s[i + 1]) : NULL;
+        if (!esc || !s[i + 1]) {
+            buf[n++] = s[i];
+            continue;
+        }
+        i++;
+        if (*esc != '0') {
+            buf[n++] = lread_escaped[esc - lread_escapes];
+        }
+    }
+    lval* x = lval_strn(buf, n);
+    free(buf);
+    return x;
+}
+
+static lval* lread_atom(lreader* r) {
+    char* s = r->cur;
+    char* p = s;
+    if (*s == '"') {
+        return lread_string(r);
+    }
+
+    if (p < r->end && *p == '-') {
+        p++;
+    }
+    char* digits = p;
+    while (p < r->end && lread_digit(*p)) {
+        p++;
+    }
+    if (p + 1 < r->end && *p == '.' && lread_digit(p[1])) {
+        p += 2;
+        while (p < r->end && lread_digit(*p)) {
+            p++;
+        }
+        r->cur = p;
+        return lread_number(s, p - s, 1);
+    }
+    if (p > digits) {
+        r->cur = p;
+        return lread_number(s, p - s, 0);
+    }
+
+    p = s;
+    while (p < r->end && lread_symbol_char(*p)) {
+        p++;
+    }
+    if (p == s) {
+        return lread_err(r, s, "unexpected '%c'", *s);
+    }
+    r->cur = p;
+    return lval_symn(s, p - s);
+}
+
+#ifdef LZP_MPC_READER
+/*
+ * The mpc fallback parses everything up front and converts the top-level
+ * nodes of the tree one at a time, like the scanner would read them.
+ */
+static void lread_mpc(lreader* r) {
+    mpc_result_t res;
+    r->ast = NULL;
+    r->next = 0;
+    if (mpc_nparse(r->name, r->src, r->end - r->src, Lzp, &res)) {
+        r->ast = res.output;
+        return;
+    }
+
+    char* msg = mpc_err_string(res.error);
+    mpc_err_delete(res.error);
+    msg[strcspn(msg, "\n")] = '\0';
+    r->cur = r->end;
+    r->failed = 1;
+    r->err = lval_err("%s", msg);
+    free(msg);
+}
+
+static lval* lread_mpc_next(lreader* r) {
+    if (r->failed) {
+        lval* err = r->err;
+        r->err = NULL;
+        return err;
+    }
+    while (r->ast && r->next < r->ast->children_num) {
+        mpc_ast_t* t = r->ast->children[r->next++];
+        if (strcmp(t->tag, "regex") == 0 || strstr(t->tag, "comment")) {
+            continue;
+        }
+        return lval_read(t);
+    }
+    if (r->ast) {
+        mpc_ast_delete(r->ast);
+        r->ast = NULL;
+    }
+    return NULL;
+}
+#endif
+
+void lreader_init(lreader* r, char* name, char* src, long len) {
+    r->name = name;
+    r->src = src;
+    r->cur = src;
+    r->end = src + len;
+    r->failed = 0;
+#ifdef LZP_MPC_READER
+    lread_mpc(r);
+#endif
+}
+
+/*
+ * Returns the next top-level expression or NULL at the end of the input.
+ * A syntax error is returned as an error with r->failed set, after which
+ * the reader stays at the end. Open expressions are
+ * kept on an explicit stack, so deep nesting does not use the C stack.
+ */
+lval* lreader_next(lreader* r) {
+#ifdef LZP_MPC_READER
+    return lread_mpc_next(r);
+#endif
+    lval* small[16];
+    lval** open = small;
+    int depth = 0;
+    int cap = 16;
+    lval* x;
+
+    while (1) {
+        lread_space(r);
+        if (r->cur == r->end) {
+            if (depth == 0) {
+                return NULL;
+            }
+            x = lread_err(r, r->cur, "expected '%c' before end of input",
+                open[depth - 1]->type == LVAL_SEXPR ? ')' : '}');
+            break;
+        }
+
+        char c = *r->cur;
+        if (c == '(' || c == '{') {
+            if (depth == cap) {
+                cap *= 2;
+                if (open == small) {
+                    open = malloc(sizeof(lval*) * cap);
+                    memcpy(open, small, sizeof(small));
+                } else {
+                    open = realloc(open, sizeof(lval*) * cap);
+                }
+            }
+            open[depth++] = c == '(' ? lval_sexpr() : lval_qexpr();
+            r->cur++;
+            continue;
+        }
+
+        if (c == ')' || c == '}') {
+            char want = depth == 0 ? 0 : open[depth - 1]->type == LVAL_SEXPR ? ')' : '}';
+            if (c != want) {
+                x = want ? lread_err(r, r->cur, "unexpected '%c', expected '%c'", c, want)
+                         : lread_err(r, r->cur, "unexpected '%c'", c);
+                break;
+            }
+            r->cur++;
+            x = open[--depth];
+        } else {
+            x = lread_atom(r);
+            if (r->failed) {
+                break;
+            }
+        }
+
+        if (depth == 0) {
+            break;
+        }
+        lval_add(open[depth - 1], x);
+    }
+
+    while (depth) {
+        lval_del(open[--depth]);
+    }
+    if (open != small) {
+        free(open);
+    }
+    return x;
+}
+
+/* Reads all of src into one S-Expression, or returns the first syntax error. */
+lval* lval_read_src(char* name, char* src, long len) {
+    lreader r;
+    lreader_init(&r, name, src, len);
+
+    lval* v = lval_sexpr();
+    lval* x;
+    while ((x = lreader_next(&r))) {
+        if (r.failed) {
+            lval_del(v);
+            return x;
+        }
+        lval_add(v, x);
+    }
+    return v;
+}
+
+/*
+ * Evaluates the top-level expressions of src as they are read, so each
+ * one is freed before the next is read and a syntax error only stops the
+ * load where it is found. Errors the expressions evaluate to are printed.
+ */
+lval* lval_load(lenv* e, char* name, char* src, long len) {
+    lreader r;
+    lreader_init(&r, name, src, len);
+
+    lval* x;
+    while ((x = lreader_next(&r))) {
+        if (r.failed) {
+            lval* err = lval_err("Could not load Library %s", x->data.err);
+            lval_del(x);
+            return err;
+        }
+
+        x = lval_eval(e, x);
+        if (x->type == LVAL_ERR) {
+            lval_println(e, x);
+        }
+        lval_del(x);
+        lgc_maybe_collect();
+    }
+    return lval_sexpr();
+}
+
+/*
+ * Source files are mapped instead of read where the platform allows it.
+ * The reader scans the mapped pages directly and never needs them NUL
+ * terminated: symbols are interned and strings copied straight out of
+ * them, so nothing refers to the mapping once the load is done.
+ */
+static char* lsrc_read(FILE* f, long* len) {
+    long cap = 4096;
+    char* src = malloc(cap);
+    *len = 0;
+    size_t n;
+    while ((n = fread(src + *len, 1, cap - *len, f)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            cap *= 2;
+            src = realloc(src, cap);
+        }
+    }
+    return src;
+}
+
+/*
+ * Files that cannot be mapped, like pipes, are read into a buffer, and
+ * *mapped tells lsrc_close() which of the two it got.
+ */
+static char* lsrc_open(char* path, long* len, int* mapped) {
+    *mapped = 0;
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char* src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src != MAP_FAILED) {
+            close(fd);
+            madvise(src, st.st_size, MADV_SEQUENTIAL);
+            *len = st.st_size;
+            *mapped = 1;
+            return src;
+        }
+    }
+    close(fd);
+#endif
+
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    char* src = lsrc_read(f, len);
+    int failed = ferror(f);
+    fclose(f);
+    if (failed) {
+        free(src);
+        return NULL;
+    }
+    return src;
+}
+
+static void lsrc_close(char* src, long len, int mapped) {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(src, len);
+        return;
+    }
+#endif
+    free(src);
+}
+
+lval* lval_load_file(lenv* e, char* path) {
+    long len;
+    int mapped;
+    char* src = lsrc_open(path, &len, &mapped);
+    if (!src) {
+        return lval_err("Could not load Library %s: error: Unable to open file!", path);
+    }
+
+    lval* v = lval_load(e, path, src, len);
+    lsrc_close(src, len, mapped);
+    return v;
+}
+
+// LENV
+
+/*
+ * Bindings are kept in insertion order in the parallel syms/vals arrays.
+ * Call frames hold a handful of names and are searched linearly; once an
+ * environment grows past LENV_INDEX_MIN bindings (the global one, or a
+ * frame that defines a lot) an open-addressing index over the interned
+ * names is built next to the arrays.
+ */
+
+#define LENV_INDEX_MIN 8
+
+/* Changes whenever a binding of a root environment does. */
+static unsigned int lenv_version = 1;
+
+/*
+ * Accounts for the binding of sym in e changing from old to v.
+ */
+static void lenv_rebind(lenv* e, char* sym, lval* old, lval* v) {
+    if (e->gc & LGC_ROOT) {
+        lenv_version++;
+    } else {
+        LSYM_NAME(sym)->bound += (v != NULL) - (old != NULL);
+    }
+}
+
+static void lenv_unbind(lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        lenv_rebind(e, e->syms[i], e->vals[i], NULL);
+    }
+}
+
+lenv* lenv_new(void) {
+    lenv* e = lenv_alloc();
+    e->par = NULL;
+    e->count = 0;
+    e->cap = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->index = NULL;
+    e->index_cap = 0;
+    return e;
+}
+
+void lenv_del(lenv* e) {
+    lenv_unbind(e);
+    for (int i = 0; i < e->count; i++) {
+        if (e->vals[i]) {
+            lval_del(e->vals[i]);
+        }
+    }
+    free(e->syms);
+    free(e->vals);
+    free(e->index);
+    lenv_free(e);
+}
+
+static unsigned int lenv_hash(char* sym) {
+    return (unsigned int)(((size_t)sym >> 3) * 2654435761u);
+}
+
+static void lenv_reindex(lenv* e, int cap) {
+    lgc_account(sizeof(int) * (long long)(cap - e->index_cap));
+    free(e->index);
+    e->index = malloc(sizeof(int) * cap);
+    e->index_cap = cap;
+    for (int i = 0; i < cap; i++) {
+        e->index[i] = -1;
+    }
+
+    for (int i = 0; i < e->count; i++) {
+        unsigned int h = lenv_hash(e->syms[i]) & (cap - 1);
+        while (e->index[h] != -1) {
+            h = (h + 1) & (cap - 1);
+        }
+        e->index[h] = i;
+    }
+}
+
+static int lenv_find(lenv* e, char* sym) {
+    if (!e->index) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == sym) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    unsigned int h = lenv_hash(sym) & (e->index_cap - 1);
+    while (e->index[h] != -1) {
+        if (e->syms[e->index[h]] == sym) {
+            return e->index[h];
+        }
+        h = (h + 1) & (e->index_cap - 1);
+    }
+    return -1;
+}
+
+/*
+ * Slot hint of a resolved symbol, checked against the frame so that a
+ * resolved body evaluated in some other environment still finds the right
+ * binding.
+ */
+static int lenv_slot(lenv* e, lval* k) {
+    if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->data.sym) {
+        return k->slot;
+    }
+    return lenv_find(e, k->data.sym);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    int i = lenv_slot(e, k);
+    if (i != -1 && e->vals[i]) {
+        return lval_copy(e->vals[i]);
+    }
+
+    if (e->par) {
+        return lenv_get(e->par, k);
+    } 
+
+    return lval_err("unbound symbol '%s'", k->data.sym);
+}
+
+lenv* lenv_copy(lenv* e) {
+    lenv* n = lenv_alloc();
+    n->par = e->par;
+    n->count = e->count;
+    n->cap = e->count;
+    n->syms = malloc(sizeof(char*) * n->count);
+    n->vals = malloc(sizeof(lval*) * n->count);
+    for (int i = 0; i < e->count; i++) {
+        n->syms[i] = e->syms[i];
+        n->vals[i] = NULL;
+        if (e->vals[i]) {
+            n->vals[i] = lval_copy(e->vals[i]);
+            lenv_rebind(n, n->syms[i], NULL, n->vals[i]);
+        }
+    }
+
+    n->index = NULL;
+    n->index_cap = 0;
+    if (e->index) {
+        n->index = malloc(sizeof(int) * e->index_cap);
+        n->index_cap = e->index_cap;
+        memcpy(n->index, e->index, sizeof(int) * e->index_cap);
+    }
+    lgc_account(lenv_bytes(n) - sizeof(lenv));
+    return n;
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+    while (e->par) {
+        e = e->par;
+    }
+    lenv_put(e, k, v);
+}
+
+lval* lenv_fetch_symbol(lenv* e, lval* v) {
+    for (int i = 0; i < e->count; i++) {
+        if (e->vals[i] && e->vals[i]->data.builtin == v->data.builtin) {
+            return lval_sym(e->syms[i]);
+        }
+    }
+
+    if (e->par) {
+        return lenv_fetch_symbol(e->par, v);
+    } 
+
+    return lval_err("functions symbol not found");
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+    int i = lenv_slot(e, k);
+    if (i != -1) {
+        lenv_rebind(e, k->data.sym, e->vals[i], v);
+        if (e->vals[i]) {
+            lval_del(e->vals[i]);
+        }
+        e->vals[i] = v ? lval_copy(v) : NULL;
+        return;
+    }
+
+    lenv_rebind(e, k->data.sym, NULL, v);
+    if (e->count == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 4;
+        lgc_account((sizeof(char*) + sizeof(lval*)) * (long long)(cap - e->cap));
+        e->cap = cap;
+        e->vals = realloc(e->vals, sizeof(lval*) * e->cap);
+        e->syms = realloc(e->syms, sizeof(char*) * e->cap);
+    }
+
+    e->count++;
+    e->vals[e->count - 1] = v ? lval_copy(v) : NULL;
+    e->syms[e->count - 1] = k->data.sym;
+
+    if (e->index && e->count * 2 <= e->index_cap) {
+        unsigned int h = lenv_hash(k->data.sym) & (e->index_cap - 1);
+        while (e->index[h] != -1) {
+            h = (h + 1) & (e->index_cap - 1);
+        }
+        e->index[h] = e->count - 1;
+    } else if (e->count > LENV_INDEX_MIN) {
+        int cap = e->index_cap ? e->index_cap * 2 : 32;
+        lenv_reindex(e, cap);
+    }
+}
+
+/*
+ * Every builtin added is recorded with the name it was added under, so
+ * images can refer to builtins by name rather than by address.
+ */
+typedef struct lbuiltin_entry {
+    char* sym;
+    lval fun;
+} lbuiltin_entry;
+
+static lbuiltin_entry* lbuiltins;
+static int lbuiltin_count;
+static int lbuiltin_cap;
+
+static void lbuiltin_register(lval* k, lval* v) {
+    if (lbuiltin_count == lbuiltin_cap) {
+        lbuiltin_cap = lbuiltin_cap ? lbuiltin_cap * 2 : 128;
+        lbuiltins = realloc(lbuiltins, sizeof(lbuiltin_entry) * lbuiltin_cap);
+    }
+    lbuiltins[lbuiltin_count].sym = k->data.sym;
+    lbuiltins[lbuiltin_count].fun = *v;
+    lbuiltin_count++;
+}
+
+/* The entry for the builtin v, NULL for one that was never added. */
+static lbuiltin_entry* lbuiltin_find(lval* v) {
+    for (int i = 0; i < lbuiltin_count; i++) {
+        lval* f = &lbuiltins[i].fun;
+        if (f->data.builtin == v->data.builtin && f->argv == v->argv && f->form == v->form) {
+            return &lbuiltins[i];
+        }
+    }
+    return NULL;
+}
+
+/* The builtin last added as sym, NULL if there is none. */
+static lbuiltin_entry* lbuiltin_named(char* sym) {
+    for (int i = lbuiltin_count - 1; i >= 0; i--) {
+        if (lbuiltins[i].sym == sym) {
+            return &lbuiltins[i];
+        }
+    }
+    return NULL;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* v = lval_builtin(func);
+    lval* k = lval_sym(name);
+    lbuiltin_register(k, v);
+    lenv_put(e, k, v);
+    lval_del(v);
+}
+
+void lenv_add_builtin_argv(lenv* e, char* name, lbuiltin_argv func) {
+    lval* v = lval_builtin_argv(func);
+    lval* k = lval_sym(name);
+    lbuiltin_register(k, v);
+    lenv_put(e, k, v);
+    lval_del(v);
+}
+
+static char* lform_syms[LFORM_COUNT];
+
+/*
+ * Adds a builtin that calls under name are compiled inline as.
+ */
+void lenv_add_form(lenv* e, char* name, lbuiltin_argv func, enum lform form) {
+    lval* v = lval_builtin_argv(func);
+    v->form = form;
+    lval* k = lval_sym(name);
+    lform_syms[form] = k->data.sym;
+    lbuiltin_register(k, v);
+    lenv_put(e, k, v);
+    lval_del(v);
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (v->type == LVAL_SEXPR) {
+        return lval_eval_sexpr(e, v);
+    }
+    return v;
+}
+
+// MEMO
+
+/*
+ * memo wraps a function in a cache of its results. The wrapper is a
+ * builtin whose memo points at the cache; the machine and lval_call()
+ * look for it before calling a builtin, and call the function itself
+ * only when the arguments are not in the cache. Only values are cached,
+ * never errors, and the function is assumed not to depend on anything
+ * but its arguments.
+ */
+
+#define LMEMO_INIT_CAP 16
+
+static unsigned int lhash_mix(unsigned long long x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned int)x;
+}
+
+static unsigned int lhash_bytes(char* s, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Structural hash agreeing with lval_eq(). Floats are equal within a
+ * tolerance, so they all hash alike and only lval_eq() tells them apart.
+ * Hashes v itself, leaving the values it holds on w to be mixed in after.
+ */
+static unsigned int lval_hash_step(lwalk* w, lval* v) {
+    unsigned int h = v->type;
+    switch (v->type) {
+        case LVAL_NUM:
+            return lhash_mix(v->data.num);
+        case LVAL_FLT:
+            return h;
+        case LVAL_ERR:
+            return lhash_bytes(v->data.err, strlen(v->data.err));
+        case LVAL_SYM:
+            return lhash_mix((uintptr_t)v->data.sym);
+        case LVAL_STR:
+            return lhash_bytes(v->data.str, v->len);
+        case LVAL_FUN:
+            if (v->data.builtin) {
+                return lhash_mix((uintptr_t)v->data.builtin ^ (uintptr_t)v->memo);
+            }
+            lwalk_push(w, v->formals);
+            lwalk_push(w, v->body);
+            for (int i = 0; i < v->env->count; i++) {
+                if (v->env->vals[i]) {
+                    lwalk_push(w, v->env->vals[i]);
+                }
+            }
+            return h;
+        default:
+            lwalk_push_cells(w, v);
+            return h * 31 + v->count;
+    }
+}
+
+static unsigned int lval_hash(lval* v) {
+    lwalk w;
+    lwalk_init(&w);
+    lwalk_push(&w, v);
+
+    unsigned int h = 0;
+    while (w.count) {
+        h = h * 31 + lval_hash_step(&w, lwalk_pop(&w));
+    }
+    lwalk_free(&w);
+    return h;
+}
+
+static unsigned int lmemo_hash(lval** x, int n) {
+    unsigned int h = n;
+    for (int i = 0; i < n; i++) {
+        h = h * 31 + lval_hash(x[i]);
+    }
+    return h;
+}
+
+static void lmemo_free(lmemo* m, void (*drop)(lval*)) {
+    lmemo_entry* x = m->newest;
+    while (x) {
+        lmemo_entry* older = x->older;
+        drop(x->args);
+        drop(x->val);
+        free(x);
+        x = older;
+    }
+    drop(m->f);
+    free(m->table);
+    free(m);
+}
+
+static void lmemo_drop(lmemo* m) {
+    if (--m->refs == 0) {
+        lmemo_free(m, lval_del);
+    }
+}
+
+static void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+    if (x->newer) {
+        x->newer->older = x->older;
+    } else {
+        m->newest = x->older;
+    }
+    if (x->older) {
+        x->older->newer = x->newer;
+    } else {
+        m->oldest = x->newer;
+    }
+}
+
+static void lmemo_link(lmemo* m, lmemo_entry* x) {
+    x->newer = NULL;
+    x->older = m->newest;
+    if (m->newest) {
+        m->newest->newer = x;
+    } else {
+        m->oldest = x;
+    }
+    m->newest = x;
+}
+
+/*
+ * The entry for the arguments x[0..n) with hash h, made the most
+ * recently used, or NULL.
+ */
+static lmemo_entry* lmemo_find(lmemo* m, unsigned int h, lval** x, int n) {
+    if (!m->cap) {
+        return NULL;
+    }
+
+    for (lmemo_entry* it = m->table[h & (m->cap - 1)]; it; it = it->chain) {
+        if (it->hash != h || it->args->count != n) {
+            continue;
+        }
+        int i = 0;
+        while (i < n && lval_eq(it->args->cell[i], x[i])) {
+            i++;
+        }
+        if (i == n) {
+            lmemo_unlink(m, it);
+            lmemo_link(m, it);
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static void lmemo_evict(lmemo* m) {
+    lmemo_entry* x = m->oldest;
+    lmemo_entry** p = &m->table[x->hash & (m->cap - 1)];
+    while (*p != x) {
+        p = &(*p)->chain;
+    }
+    *p = x->chain;
+    lmemo_unlink(m, x);
+    lval_del(x->args);
+    lval_del(x->val);
+    free(x);
+    m->stats.size--;
+    m->stats.evictions++;
+}
+
+static void lmemo_grow(lmemo* m) {
+    int cap = m->cap ? m->cap * 2 : LMEMO_INIT_CAP;
+    lmemo_entry** table = calloc(cap, sizeof(lmemo_entry*));
+    for (lmemo_entry* x = m->newest; x; x = x->older) {
+        lmemo_entry** b = &table[x->hash & (cap - 1)];
+        x->chain = *b;
+        *b = x;
+    }
+    free(m->table);
+    m->table = table;
+    m->cap = cap;
+}
+
+/*
+ * Caches val as the result for the arguments args, taking args.
+ */
+static void lmemo_put(lmemo* m, lval* args, lval* val) {
+    unsigned int h = lmemo_hash(args->cell, args->count);
+    if (val->type == LVAL_ERR || lmemo_find(m, h, args->cell, args->count)) {
+        lval_del(args);
+        return;
+    }
+
+    if (m->stats.max && m->stats.size == m->stats.max) {
+        lmemo_evict(m);
+    }
+    if (m->stats.size >= m->cap / 4 * 3) {
+        lmemo_grow(m);
+    }
+
+    lmemo_entry* x = malloc(sizeof(lmemo_entry));
+    x->hash = h;
+    x->args = args;
+    x->val = lval_copy(val);
+    lmemo_entry** b = &m->table[h & (m->cap - 1)];
+    x->chain = *b;
+    *b = x;
+    lmemo_link(m, x);
+    m->stats.size++;
+}
+
+/*
+ * Looks the arguments x[0..n) up in the cache of m. Returns the cached
+ * value, or NULL after counting a miss.
+ */
+static lval* lmemo_get(lmemo* m, lval** x, int n) {
+    lmemo_entry* it = lmemo_find(m, lmemo_hash(x, n), x, n);
+    if (!it) {
+        m->stats.misses++;
+        return NULL;
+    }
+    m->stats.hits++;
+    return lval_copy(it->val);
+}
+
+/*
+ * The key to cache a call with the arguments a under. It is a view of
+ * their cells of its own, as binding the arguments takes a apart.
+ */
+static lval* lmemo_key(lval* a) {
+    return lval_slice(lval_copy(a), 0, a->count);
+}
+
+static lval* lmemo_builtin(lenv* e, int argc, lval** argv) {
+    (void)e;
+    (void)argc;
+    (void)argv;
+    /* Not reached: calls of a memoised function go through its cache. */
+    return lval_err("Memoised function called without its cache.");
+}
+
+/*
+ * Wraps f in a cache of at most max results, or any number if max is 0.
+ */
+lval* lval_memo(lval* f, int max) {
+    lval* v = lval_builtin_argv(lmemo_builtin);
+    v->memo = calloc(1, sizeof(lmemo));
+    v->memo->refs = 1;
+    v->memo->f = f;
+    v->memo->stats.max = max;
+    return v;
+}
+
+int lval_memo_stats(lval* f, lmemo_stats* s) {
+    if (f->type != LVAL_FUN || !f->data.builtin || !f->memo) {
+        return 0;
+    }
+    *s = f->memo->stats;
+    return 1;
+}
+
+// IMAGE
+
+/*
+ * An image is the global bindings of an environment in a compact binary
+ * form, so a prepared environment can be restored without reading or
+ * evaluating any source. After a magic word and a version byte it holds
+ * the number of bindings followed by name and value for each of them.
+ *
+ * A value is a tag byte and its contents. Counts and lengths are LEB128
+ * varints and integers are zigzag encoded. Every value but a number is
+ * numbered in the order it is first written; writing it again writes a
+ * reference to that number, so shared bodies and symbols stay shared.
+ * Values cannot hold themselves, so a reference always points at a value
+ * that has been read completely. Lambdas are written as their frame template, formals and
+ * resolved body, so nothing has to be resolved again when reading, and
+ * builtins by the name they were added under. Compiled code and memo
+ * tables are not saved; they are rebuilt as the values are used.
+ *
+ * Values are written and read recursively, so how deeply they may nest
+ * is bounded by LIMG_MAX_DEPTH. Deeper values are refused when saving,
+ * and an image holding one is malformed.
+ */
+
+#define LIMG_MAGIC "LZPI"
+#define LIMG_VERSION 1
+#define LIMG_MAX_DEPTH 10000
+
+enum limg_tag {
+    LIMG_NONE,
+    LIMG_REF,
+    LIMG_NUM,
+    LIMG_FLT,
+    LIMG_ERR,
+    LIMG_SYM,
+    LIMG_SLOT,
+    LIMG_STR,
+    LIMG_SEXPR,
+    LIMG_QEXPR,
+    LIMG_BUILTIN,
+    LIMG_LAMBDA,
+    LIMG_MEMO
+};
+
+/*
+ * Resolution gives every local in a body a node of its own. They never
+ * change, so the writer numbers them by name and slot and the reader
+ * shares one node between them.
+ */
+typedef struct limg_slots {
+    lval** vals;
+    int count;
+    int cap;
+} limg_slots;
+
+static unsigned int limg_slot_hash(lval* v) {
+    return (unsigned int)((((size_t)v->data.sym >> 3) ^ v->slot) * 2654435761u);
+}
+
+/* Returns the local with the name and slot of v, adding v if there is none. */
+static lval* limg_slot(limg_slots* t, lval* v) {
+    if ((t->count + 1) * 2 > t->cap) {
+        int cap = t->cap ? t->cap * 2 : 64;
+        lval** vals = calloc(cap, sizeof(lval*));
+        for (int i = 0; i < t->cap; i++) {
+            if (t->vals[i]) {
+                unsigned int h = limg_slot_hash(t->vals[i]) & (cap - 1);
+                while (vals[h]) {
+                    h = (h + 1) & (cap - 1);
+                }
+                vals[h] = t->vals[i];
+            }
+        }
+        free(t->vals);
+        t->vals = vals;
+        t->cap = cap;
+    }
+
+    unsigned int h = limg_slot_hash(v) & (t->cap - 1);
+    while (t->vals[h]) {
+        lval* x = t->vals[h];
+        if (x->data.sym == v->data.sym && x->slot == v->slot) {
+            return x;
+        }
+        h = (h + 1) & (t->cap - 1);
+    }
+    t->vals[h] = v;
+    t->count++;
+    return v;
+}
+
+typedef struct limg_writer {
+    unsigned char* buf;
+    long len;
+    long cap;
+    lval** keys;
+    int* ids;
+    int count;
+    int map_cap;
+    limg_slots slots;
+    lval* err;
+} limg_writer;
+
+static void limg_put(limg_writer* w, const void* data, long len) {
+    if (w->len + len > w->cap) {
+        while (w->len + len > w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 4096;
+        }
+        w->buf = realloc(w->buf, w->cap);
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void limg_put_byte(limg_writer* w, unsigned char c) {
+    limg_put(w, &c, 1);
+}
+
+static void limg_put_uint(limg_writer* w, unsigned long long x) {
+    unsigned char b[10];
+    int n = 0;
+    do {
+        b[n] = x & 0x7f;
+        x >>= 7;
+        if (x) {
+            b[n] |= 0x80;
+        }
+        n++;
+    } while (x);
+    limg_put(w, b, n);
+}
+
+static void limg_put_str(limg_writer* w, char* s, long len) {
+    limg_put_uint(w, len);
+    limg_put(w, s, len);
+}
+
+static unsigned int limg_hash(lval* v) {
+    return (unsigned int)(((size_t)v >> 4) * 2654435761u);
+}
+
+/* Numbers v if it is new, otherwise returns the number it was given. */
+static int limg_number(limg_writer* w, lval* v) {
+    if ((w->count + 1) * 2 > w->map_cap) {
+        int cap = w->map_cap ? w->map_cap * 2 : 256;
+        lval** keys = calloc(cap, sizeof(lval*));
+        int* ids = malloc(sizeof(int) * cap);
+        for (int i = 0; i < w->map_cap; i++) {
+            if (w->keys[i]) {
+                unsigned int h = limg_hash(w->keys[i]) & (cap - 1);
+                while (keys[h]) {
+                    h = (h + 1) & (cap - 1);
+                }
+                keys[h] = w->keys[i];
+                ids[h] = w->ids[i];
+            }
+        }
+        free(w->keys);
+        free(w->ids);
+        w->keys = keys;
+        w->ids = ids;
+        w->map_cap = cap;
+    }
+
+    unsigned int h = limg_hash(v) & (w->map_cap - 1);
+    while (w->keys[h]) {
+        if (w->keys[h] == v) {
+            return w->ids[h];
+        }
+        h = (h + 1) & (w->map_cap - 1);
+    }
+    w->keys[h] = v;
+    w->ids[h] = w->count++;
+    return -1;
+}
+
+static void limg_write(limg_writer* w, lval* v, int depth);
+
+static void limg_write_env(limg_writer* w, lenv* e, int depth) {
+    limg_put_uint(w, e->count);
+    for (int i = 0; i < e->count; i++) {
+        limg_write(w, lval_sym(e->syms[i]), depth);
+        if (e->vals[i]) {
+            limg_write(w, e->vals[i], depth);
+        } else {
+            limg_put_byte(w, LIMG_NONE);
+        }
+    }
+}
+
+static void limg_write(limg_writer* w, lval* v, int depth) {
+    if (w->err) {
+        return;
+    }
+    if (depth > LIMG_MAX_DEPTH) {
+        w->err = lval_err("Value is nested too deeply to save");
+        return;
+    }
+    if (v->type == LVAL_NUM) {
+        limg_put_byte(w, LIMG_NUM);
+        limg_put_uint(w, ((unsigned long long)v->data.num << 1) ^ (unsigned long long)(v->data.num >> 63));
+        return;
+    }
+
+    if (v->type == LVAL_SYM && v->slot != -1) {
+        v = limg_slot(&w->slots, v);
+    }
+
+    int id = limg_number(w, v);
+    if (id != -1) {
+        limg_put_byte(w, LIMG_REF);
+        limg_put_uint(w, id);
+        return;
+    }
+
+    switch (v->type) {
+        case LVAL_FLT: {
+            uint64_t bits;
+            memcpy(&bits, &v->data.flt, sizeof(bits));
+            limg_put_byte(w, LIMG_FLT);
+            for (int i = 0; i < 8; i++) {
+                limg_put_byte(w, (bits >> (8 * i)) & 0xff);
+            }
+            break;
+        }
+        case LVAL_ERR:
+            limg_put_byte(w, LIMG_ERR);
+            limg_put_str(w, v->data.err, strlen(v->data.err));
+            break;
+        case LVAL_SYM:
+            if (v->slot == -1) {
+                limg_put_byte(w, LIMG_SYM);
+                limg_put_str(w, v->data.sym, strlen(v->data.sym));
+            } else {
+                limg_put_byte(w, LIMG_SLOT);
+                limg_put_uint(w, v->slot);
+                limg_write(w, lval_sym(v->data.sym), depth + 1);
+            }
+            break;
+        case LVAL_STR:
+            limg_put_byte(w, LIMG_STR);
+            limg_put_str(w, v->data.str, v->len);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            limg_put_byte(w, v->type == LVAL_SEXPR ? LIMG_SEXPR : LIMG_QEXPR);
+            limg_put_uint(w, v->count);
+            for (int i = 0; i < v->count; i++) {
+                limg_write(w, v->cell[i], depth + 1);
+            }
+            break;
+        case LVAL_FUN:
+            if (!v->data.builtin) {
+                limg_put_byte(w, LIMG_LAMBDA);
+                limg_write_env(w, v->env, depth + 1);
+                limg_write(w, v->formals, depth + 1);
+                limg_write(w, v->body, depth + 1);
+            } else if (v->memo) {
+                limg_put_byte(w, LIMG_MEMO);
+                limg_put_uint(w, v->memo->stats.max);
+                limg_write(w, v->memo->f, depth + 1);
+            } else {
+                lbuiltin_entry* b = lbuiltin_find(v);
+                if (!b) {
+                    w->err = lval_err("Cannot save a builtin that was never added");
+                    return;
+                }
+                limg_put_byte(w, LIMG_BUILTIN);
+                limg_write(w, lval_sym(b->sym), depth + 1);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Builtins bound under the name they were added as are left out of an
+ * image, as every image is loaded into an environment that has them.
+ */
+static int limg_saves(lenv* e, int i) {
+    lval* v = e->vals[i];
+    if (!v) {
+        return 0;
+    }
+    if (v->type != LVAL_FUN || !v->data.builtin || v->memo) {
+        return 1;
+    }
+
+    lbuiltin_entry* b = lbuiltin_named(e->syms[i]);
+    return !b || b->fun.data.builtin != v->data.builtin
+        || b->fun.argv != v->argv || b->fun.form != v->form;
+}
+
+/* Writes the bindings of the global environment of e to path. */
+lval* lenv_save_image(lenv* e, char* path) {
+    while (e->par) {
+        e = e->par;
+    }
+
+    limg_writer w = {0};
+    int count = 0;
+    for (int i = 0; i < e->count; i++) {
+        count += limg_saves(e, i);
+    }
+
+    limg_put(&w, LIMG_MAGIC, 4);
+    limg_put_byte(&w, LIMG_VERSION);
+    limg_put_uint(&w, count);
+    for (int i = 0; i < e->count; i++) {
+        if (limg_saves(e, i)) {
+            limg_write(&w, lval_sym(e->syms[i]), 0);
+            limg_write(&w, e->vals[i], 0);
+        }
+    }
+
+    lval* r = w.err;
+    if (!r) {
+        FILE* f = fopen(path, "wb");
+        if (!f || fwrite(w.buf, 1, w.len, f) != (size_t)w.len) {
+            r = lval_err("Could not write image %s", path);
+        } else {
+            r = lval_sexpr();
+        }
+        if (f && fclose(f) != 0 && r->type != LVAL_ERR) {
+            lval_del(r);
+            r = lval_err("Could not write image %s", path);
+        }
+    }
+
+    free(w.buf);
+    free(w.keys);
+    free(w.ids);
+    free(w.slots.vals);
+    return r;
+}
+
+typedef struct limg_reader {
+    const unsigned char* cur;
+    const unsigned char* end;
+    lval** vals;
+    int count;
+    int cap;
+    limg_slots slots;
+} limg_reader;
+
+static void limg_reader_free(limg_reader* r) {
+    for (int i = 0; i < r->slots.cap; i++) {
+        if (r->slots.vals[i]) {
+            lval_del(r->slots.vals[i]);
+        }
+    }
+    free(r->slots.vals);
+    free(r->vals);
+}
+
+static int limg_get_uint(limg_reader* r, unsigned long long* x) {
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->cur == r->end) {
+            return 0;
+        }
+        unsigned char b = *r->cur++;
+        *x |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int limg_get_len(limg_reader* r, long* len) {
+    unsigned long long x;
+    if (!limg_get_uint(r, &x) || x > (unsigned long long)(r->end - r->cur)) {
+        return 0;
+    }
+    *len = x;
+    return 1;
+}
+
+/*
+ * Numbers the next value and returns its number. The value is filled in
+ * with limg_set() once it has been read completely.
+ */
+static int limg_reserve(limg_reader* r) {
+    if (r->count == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->vals = realloc(r->vals, sizeof(lval*) * r->cap);
+    }
+    r->vals[r->count] = NULL;
+    return r->count++;
+}
+
+static lval* limg_set(limg_reader* r, int id, lval* v) {
+    r->vals[id] = v;
+    return v;
+}
+
+static lval* limg_read(limg_reader* r, int depth);
+
+/* Reads a value that has to be a symbol, as binding names are. */
+static lval* limg_read_sym(limg_reader* r, int depth) {
+    lval* k = limg_read(r, depth);
+    if (k && (k->type != LVAL_SYM || k->slot != -1)) {
+        lval_del(k);
+        return NULL;
+    }
+    return k;
+}
+
+static lenv* limg_read_env(limg_reader* r, int depth) {
+    unsigned long long count;
+    if (!limg_get_uint(r, &count) || count > (unsigned long long)(r->end - r->cur)) {
+        return NULL;
+    }
+
+    lenv* e = lenv_new();
+    for (unsigned long long i = 0; i < count; i++) {
+        lval* k = limg_read_sym(r, depth);
+        if (!k) {
+            lenv_del(e);
+            return NULL;
+        }
+        if (r->cur != r->end && *r->cur == LIMG_NONE) {
+            r->cur++;
+            lenv_put(e, k, NULL);
+            continue;
+        }
+        lval* v = limg_read(r, depth);
+        if (!v) {
+            lenv_del(e);
+            return NULL;
+        }
+        lenv_put(e, k, v);
+        lval_del(v);
+    }
+    return e;
+}
+
+/*
+ * True when every local in the body v refers to a slot of a frame of n.
+ * A body built from references can nest deeper than any value read, so
+ * this is bounded too.
+ */
+static int limg_slots_ok(lval* v, int n, int depth) {
+    if (depth > LIMG_MAX_DEPTH) {
+        return 0;
+    }
+    if (v->type == LVAL_SYM) {
+        return v->slot < n;
+    }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i = 0; i < v->count; i++) {
+            if (!limg_slots_ok(v->cell[i], n, depth + 1)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * True when formals is a list of interned symbols, each a slot of the
+ * template e, with any '&' followed by exactly one symbol, as lval_bind()
+ * and lenv_put() take for granted.
+ */
+static int limg_formals_ok(lval* formals, lenv* e) {
+    for (int i = 0; i < formals->count; i++) {
+        lval* sym = formals->cell[i];
+        if (sym->type != LVAL_SYM || sym->slot != -1) {
+            return 0;
+        }
+        if (sym->data.sym == lsym_amp) {
+            if (formals->count - i != 2) {
+                return 0;
+            }
+            continue;
+        }
+        if (lenv_slot(e, sym) == -1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the next value, or NULL when the image is malformed. */
+static lval* limg_read(limg_reader* r, int depth) {
+    if (r->cur == r->end || depth > LIMG_MAX_DEPTH) {
+        return NULL;
+    }
+
+    unsigned char tag = *r->cur++;
+    unsigned long long x;
+    long len;
+
+    if (tag == LIMG_NUM) {
+        if (!limg_get_uint(r, &x)) {
+            return NULL;
+        }
+        return lval_num((long long)(x >> 1) ^ -(long long)(x & 1));
+    }
+    if (tag == LIMG_REF) {
+        if (!limg_get_uint(r, &x) || x >= (unsigned long long)r->count || !r->vals[x]) {
+            return NULL;
+        }
+        return lval_copy(r->vals[x]);
+    }
+
+    int id = limg_reserve(r);
+    switch (tag) {
+        case LIMG_FLT: {
+            if (r->end - r->cur < 8) {
+                return NULL;
+            }
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) {
+                bits |= (uint64_t)*r->cur++ << (8 * i);
+            }
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return limg_set(r, id, lval_flt(d));
+        }
+        case LIMG_ERR:
+        case LIMG_SYM:
+        case LIMG_STR: {
+            if (!limg_get_len(r, &len)) {
+                return NULL;
+            }
+            char* s = (char*)r->cur;
+            r->cur += len;
+            if (tag == LIMG_STR) {
+                return limg_set(r, id, lval_strn(s, len));
+            }
+            if (tag == LIMG_SYM) {
+                if (len == 0 || memchr(s, '\0', len)) {
+                    return NULL;
+                }
+                return limg_set(r, id, lval_symn(s, len));
+            }
+            return limg_set(r, id, lval_err("%.*s", (int)len, s));
+        }
+        case LIMG_SLOT: {
+            if (!limg_get_uint(r, &x) || x > INT_MAX) {
+                return NULL;
+            }
+            lval* k = limg_read_sym(r, depth + 1);
+            if (!k) {
+                return NULL;
+            }
+            lval* v = lval_alloc();
+            v->type = LVAL_SYM;
+            v->refs = 1;
+            v->data.sym = k->data.sym;
+            v->slot = x;
+
+            lval* s = limg_slot(&r->slots, v);
+            if (s != v) {
+                lval_del(v);
+            }
+            return limg_set(r, id, lval_copy(s));
+        }
+        case LIMG_SEXPR:
+        case LIMG_QEXPR: {
+            if (!limg_get_uint(r, &x) || x > (unsigned long long)(r->end - r->cur)) {
+                return NULL;
+            }
+            lval* v = tag == LIMG_SEXPR ? lval_sexpr() : lval_qexpr();
+            if (x) {
+                v->buf = lcells_new(x);
+                v->cell = v->buf->cell;
+            }
+            for (unsigned long long i = 0; i < x; i++) {
+                lval* c = limg_read(r, depth + 1);
+                if (!c) {
+                    lval_del(v);
+                    return NULL;
+                }
+                v->cell[v->count++] = c;
+                v->buf->hi++;
+            }
+            return limg_set(r, id, v);
+        }
+        case LIMG_BUILTIN: {
+            lval* k = limg_read_sym(r, depth + 1);
+            lbuiltin_entry* b = k ? lbuiltin_named(k->data.sym) : NULL;
+            if (!b) {
+                return NULL;
+            }
+            lval* v = b->fun.argv ? lval_builtin_argv(b->fun.data.builtin_argv)
+                                  : lval_builtin(b->fun.data.builtin);
+            v->form = b->fun.form;
+            return limg_set(r, id, v);
+        }
+        case LIMG_LAMBDA: {
+            lenv* e = limg_read_env(r, depth + 1);
+            lval* formals = e ? limg_read(r, depth + 1) : NULL;
+            lval* body = formals ? limg_read(r, depth + 1) : NULL;
+            if (!body || formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR
+                || !limg_formals_ok(formals, e) || !limg_slots_ok(body, e->count, 0)) {
+                if (e) {
+                    lenv_del(e);
+                }
+                if (formals) {
+                    lval_del(formals);
+                }
+                if (body) {
+                    lval_del(body);
+                }
+                return NULL;
+            }
+
+            lval* v = lval_alloc();
+            v->type = LVAL_FUN;
+            v->refs = 1;
+            v->data.builtin = NULL;
+            v->env = e;
+            v->formals = formals;
+            v->body = body;
+            return limg_set(r, id, v);
+        }
+        case LIMG_MEMO: {
+            if (!limg_get_uint(r, &x) || x > INT_MAX) {
+                return NULL;
+            }
+            lval* f = limg_read(r, depth + 1);
+            if (!f || f->type != LVAL_FUN) {
+                if (f) {
+                    lval_del(f);
+                }
+                return NULL;
+            }
+            return limg_set(r, id, lval_memo(f, x));
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Defines the bindings of the image in data in the global environment of
+ * e. Nothing is defined unless the whole image could be read.
+ */
+lval* lenv_load_image(lenv* e, const unsigned char* data, long len) {
+    limg_reader r = { data, data + len, NULL, 0, 0, { NULL, 0, 0 } };
+    if (len < 5 || memcmp(data, LIMG_MAGIC, 4) != 0) {
+        return lval_err("Not an lzp image");
+    }
+    if (data[4] != LIMG_VERSION) {
+        return lval_err("Image version %d is not supported, expected %d", data[4], LIMG_VERSION);
+    }
+    r.cur += 5;
+
+    unsigned long long count;
+    if (!limg_get_uint(&r, &count) || count > (unsigned long long)len) {
+        return lval_err("Image is malformed");
+    }
+
+    lval* bindings = lval_sexpr();
+    for (unsigned long long i = 0; i < count * 2; i++) {
+        lval* v = i % 2 ? limg_read(&r, 0) : limg_read_sym(&r, 0);
+        if (!v) {
+            lval_del(bindings);
+            limg_reader_free(&r);
+            return lval_err("Image is malformed");
+        }
+        lval_add(bindings, v);
+    }
+    limg_reader_free(&r);
+
+    for (int i = 0; i < bindings->count; i += 2) {
+        lenv_def(e, bindings->cell[i], bindings->cell[i + 1]);
+    }
+    lval_del(bindings);
+    return lval_sexpr();
+}
+
+lval* lenv_load_image_file(lenv* e, char* path) {
+    long len;
+    int mapped;
+    char* data = lsrc_open(path, &len, &mapped);
+    if (!data) {
+        return lval_err("Could not open image %s", path);
+    }
+
+    lval* r = lenv_load_image(e, (unsigned char*)data, len);
+    lsrc_close(data, len, mapped);
+    return r;
+}
+
+// VM
+
+/*
+ * Code is compiled to bytecode for a small stack machine the first time
+ * it runs, and the code is kept on the expression's cell buffer, so a
+ * lambda body or a branch held as a constant inside one is compiled only
+ * once. Each S-expression becomes the code of its children followed by
+ * LVM_CALL, which evaluates the S-expression holding the values on top
+ * of the stack. Nothing is copied out of the tree: symbols are looked up
+ * and constants pushed straight from the cells.
+ *
+ * A call to one of the special forms (see enum lform) whose arguments
+ * have the shape the form expects is compiled inline instead: the
+ * branches of 'if' and the arguments of 'do', '&&' and '||' become jumps
+ * over code in the same frame, so only what is needed is evaluated, and
+ * 'def', '=' and '\' take their literal arguments without the list being
+ * built. The head is still looked up when the form runs; when it is not
+ * bound to the builtin any more, LVM_FORM evaluates the S-expression the
+ * ordinary way in a frame of its own and skips the inline code.
+ *
+ * Evaluation runs on an explicit stack of frames in the heap rather than
+ * on the C stack. A frame runs the code of one expression in an
+ * environment; a frame running a lambda body also owns the activation,
+ * the environment binding the arguments of that call, which is freed
+ * when the frame returns. The lambda itself is never written to, so it
+ * is shared by every call instead of being copied for each.
+ * Calling a lambda pushes a frame for its body, and a builtin such as
+ * 'eval' that evaluates a Q-expression as its result hands it back as
+ * ljump_mark to be pushed as a frame as well. A builtin such as 'map'
+ * that calls functions is resumed by a frame of its own instead, see
+ * lval_resume().
+ * Nesting is only limited by the maximum depth (the -s flag or
+ * LZP_STACK_DEPTH), past which the call evaluates to an error.
+ *
+ * A call in tail position, LVM_TAIL, replaces the frame instead of
+ * pushing a new one, so tail recursion runs in constant depth. The
+ * caller's activation has to stay alive, as it is the callee's parent,
+ * so the frame holds on to it; a function calling itself in tail
+ * position rebinds its arguments in the activation it already has
+ * instead, which looks the same from inside.
+ */
+
+#define LVM_MAX_DEPTH 100000
+
+/*
+ * A builtin that evaluates something outside of the machine's frames, with
+ * lval_eval() or lval_call(), runs the machine again below itself on the C
+ * stack. The depth of that nesting is bounded separately, low enough for
+ * the C stack to hold it.
+ */
+#define LVM_MAX_RUNS 4096
+
+/*
+ * Compiling recurses on the S-expressions nested in the code. Those nested
+ * deeper than this are left as constants that LVM_EVAL runs in frames of
+ * their own, compiled when they first run.
+ */
+#define LCODE_MAX_NEST 1000
+
+/*
+ * Operands follow each op in the code; L is the index of an op to jump to.
+ */
+enum {
+    LVM_CONST,  /* k: push constant k */
+    LVM_LOAD,   /* k: push the value of symbol constant k */
+    LVM_CALL,   /* n: evaluate the S-expression of the top n values */
+    LVM_TAIL,   /* n: the same, in tail position */
+    LVM_JUMP,   /* L */
+    LVM_FORM,   /* k form node L: unless symbol k is bound to the form,
+                   evaluate constant node (-1 for the whole code) and
+                   jump to L */
+    LVM_IF,     /* L1 L2: pop the condition and go on if it is true, jump
+                   to L1 if false, or push an error and jump to L2 */
+    LVM_AND,    /* L: pop; when false push 0 and jump to L */
+    LVM_OR,     /* L: pop; when true push 1 and jump to L */
+    LVM_TRUTH,  /* replace the top with 1 if it is true, 0 if false */
+    LVM_DROP,   /* L: pop, or jump to L leaving it if it is an error */
+    LVM_DEF,    /* k n: bind the symbols of constant k to the top n
+                   values globally */
+    LVM_PUT,    /* k n: the same, locally */
+    LVM_LAMBDA, /* k: push the lambda of formals k and body k + 1 */
+    LVM_LET,    /* k tail: evaluate constant k in a new scope */
+    LVM_EVAL,   /* k: evaluate constant k in a frame of its own */
+    LVM_RESUME  /* resume the builtin of the frame */
+};
+
+typedef struct lvm_frame {
+    lcode* c;
+    int pc;
+    lenv* e;
+    lval* code;
+    lval* f;
+    lenv* act;
+    lenv** held;
+    int held_count;
+    lmemo* memo;
+    lval* memo_key;
+    lresume resume;
+    int asked;
+} lvm_frame;
+
+typedef struct lvm_state {
+    lval** stack;
+    int sp;
+    int cap;
+    lvm_frame* frames;
+    int fp;
+    int frame_cap;
+    int max;
+    int runs;
+} lvm_state;
+
+static _Thread_local lvm_state lvm;
+
+/*
+ * Set by the machine right before it calls a builtin, and cleared by
+ * anything else that starts evaluating. While it is set,
+ * lval_eval_qexpr() does not evaluate but stores the expression here and
+ * returns ljump_mark, which the builtin has to return as it is. A scope
+ * from lval_eval_scope() comes with the environment in act, for the
+ * frame to own. lval_resume() leaves the function to resume in resume.
+ * A resumed function asking for a value sets back, and for a call puts
+ * the function and its arguments on the stack, counted in call.
+ */
+typedef struct ljump_state {
+    int ok;
+    lval* v;
+    lenv* e;
+    lenv* act;
+    lresume resume;
+    int back;
+    int call;
+} ljump_state;
+
+static _Thread_local ljump_state ljump;
+static lval ljump_mark = { .type = LVAL_SEXPR, .refs = 1, .gc = LGC_PERM };
+
+static int lcode_nil_ops[] = { LVM_CALL, 0 };
+static lcode lcode_nil = {
+    .refs = 1, .ops = lcode_nil_ops, .op_count = 2, .stack = 1
+};
+
+static int lcode_resume_ops[] = { LVM_RESUME };
+static lcode lcode_resume = {
+    .refs = 1, .ops = lcode_resume_ops, .op_count = 1, .stack = 1
+};
+
+/*
+ * Appends x to the code and returns where it is, to patch a jump later.
+ */
+static int lcode_emit(lcode* c, int x) {
+    if (c->op_count == c->op_cap) {
+        c->op_cap = c->op_cap ? c->op_cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->op_cap);
+    }
+    c->ops[c->op_count] = x;
+    return c->op_count++;
+}
+
+/*
+ * Points the jump operand at i to the end of the code so far.
+ */
+static void lcode_patch(lcode* c, int i) {
+    c->ops[i] = c->op_count;
+}
+
+static int lcode_const(lcode* c, lval* v) {
+    if (c->const_count == c->const_cap) {
+        c->const_cap = c->const_cap ? c->const_cap * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval*) * c->const_cap);
+    }
+    c->consts[c->const_count] = v;
+    return c->const_count++;
+}
+
+static void lcode_expr(lcode* c, lval* v, int depth, int tail);
+static void lcode_sexpr(lcode* c, lval* node, int depth, int tail);
+
+static int lcode_syms(lval* v) {
+    if (v->type != LVAL_QEXPR) {
+        return 0;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type != LVAL_SYM) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The form the S-expression node calls, if its arguments have the shape
+ * the form is compiled for.
+ */
+static int lcode_form_of(lval* node) {
+    lval** x = node->cell;
+    int n = node->count;
+    if (x[0]->type != LVAL_SYM) {
+        return LFORM_NONE;
+    }
+
+    int form = LFORM_NONE;
+    for (int i = 1; i < LFORM_COUNT; i++) {
+        if (lform_syms[i] == x[0]->data.sym) {
+            form = i;
+        }
+    }
+
+    switch (form) {
+        case LFORM_IF:
+            return n == 4 && x[2]->type == LVAL_QEXPR
+                && x[3]->type == LVAL_QEXPR ? form : LFORM_NONE;
+        case LFORM_DEF:
+        case LFORM_PUT:
+            return lcode_syms(x[1]) && x[1]->count == n - 2 ? form : LFORM_NONE;
+        case LFORM_LAMBDA:
+            return n == 3 && lcode_syms(x[1])
+                && x[2]->type == LVAL_QEXPR ? form : LFORM_NONE;
+        case LFORM_LET:
+            return n == 2 && x[1]->type == LVAL_QEXPR ? form : LFORM_NONE;
+        default:
+            return n >= 2 ? form : LFORM_NONE;
+    }
+}
+
+/*
+ * Compiles the call of the form to node inline, guarded by LVM_FORM.
+ * root is set for the expression the whole code was compiled from.
+ */
+static void lcode_form(lcode* c, lval* node, int form, int depth, int tail, int root) {
+    lval** x = node->cell;
+    int n = node->count;
+    int ends[n + 1];
+    int end_count = 0;
+
+    lcode_emit(c, LVM_FORM);
+    lcode_emit(c, lcode_const(c, x[0]));
+    lcode_emit(c, form);
+    lcode_emit(c, root ? -1 : lcode_const(c, node));
+    ends[end_count++] = lcode_emit(c, 0);
+
+    switch (form) {
+        case LFORM_IF: {
+            lcode_expr(c, x[1], depth, 0);
+            lcode_emit(c, LVM_IF);
+            int other = lcode_emit(c, 0);
+            ends[end_count++] = lcode_emit(c, 0);
+            lcode_sexpr(c, x[2], depth, tail);
+            lcode_emit(c, LVM_JUMP);
+            ends[end_count++] = lcode_emit(c, 0);
+            lcode_patch(c, other);
+            lcode_sexpr(c, x[3], depth, tail);
+            break;
+        }
+        case LFORM_DEF:
+        case LFORM_PUT:
+            for (int i = 2; i < n; i++) {
+                lcode_expr(c, x[i], depth + i - 2, 0);
+            }
+            lcode_emit(c, form == LFORM_DEF ? LVM_DEF : LVM_PUT);
+            lcode_emit(c, lcode_const(c, x[1]));
+            lcode_emit(c, n - 2);
+            break;
+        case LFORM_LAMBDA:
+            lcode_emit(c, LVM_LAMBDA);
+            lcode_emit(c, lcode_const(c, x[1]));
+            lcode_const(c, x[2]);
+            break;
+        case LFORM_LET:
+            lcode_emit(c, LVM_LET);
+            lcode_emit(c, lcode_const(c, x[1]));
+            lcode_emit(c, tail);
+            break;
+        case LFORM_DO:
+            for (int i = 1; i < n - 1; i++) {
+                lcode_expr(c, x[i], depth, 0);
+                lcode_emit(c, LVM_DROP);
+                ends[end_count++] = lcode_emit(c, 0);
+            }
+            lcode_expr(c, x[n - 1], depth, tail);
+            break;
+        default:
+            for (int i = 1; i < n - 1; i++) {
+                lcode_expr(c, x[i], depth, 0);
+                lcode_emit(c, form == LFORM_AND ? LVM_AND : LVM_OR);
+                ends[end_count++] = lcode_emit(c, 0);
+            }
+            lcode_expr(c, x[n - 1], depth, 0);
+            lcode_emit(c, LVM_TRUTH);
+            break;
+    }
+
+    while (end_count) {
+        lcode_patch(c, ends[--end_count]);
+    }
+}
+
+static void lcode_call(lcode* c, lval* node, int depth, int tail) {
+    for (int i = 0; i < node->count; i++) {
+        lcode_expr(c, node->cell[i], depth + i, 0);
+    }
+    lcode_emit(c, tail ? LVM_TAIL : LVM_CALL);
+    lcode_emit(c, node->count);
+}
+
+static void lcode_sexpr(lcode* c, lval* node, int depth, int tail) {
+    if (c->nest == LCODE_MAX_NEST) {
+        if (depth + 1 > c->stack) {
+            c->stack = depth + 1;
+        }
+        lcode_emit(c, LVM_EVAL);
+        lcode_emit(c, lcode_const(c, node));
+        return;
+    }
+
+    c->nest++;
+    int form = node->count > 1 ? lcode_form_of(node) : LFORM_NONE;
+    if (node->count == 1) {
+        lcode_expr(c, node->cell[0], depth, tail);
+    } else if (form) {
+        lcode_form(c, node, form, depth, tail, 0);
+    } else {
+        lcode_call(c, node, depth, tail);
+    }
+    c->nest--;
+}
+
+static void lcode_expr(lcode* c, lval* v, int depth, int tail) {
+    if (depth + 1 > c->stack) {
+        c->stack = depth + 1;
+    }
+
+    switch (v->type) {
+        case LVAL_SYM:
+            lcode_emit(c, LVM_LOAD);
+            lcode_emit(c, lcode_const(c, v));
+            break;
+        case LVAL_SEXPR:
+            lcode_sexpr(c, v, depth, tail);
+            break;
+        default:
+            lcode_emit(c, LVM_CONST);
+            lcode_emit(c, lcode_const(c, v));
+            break;
+    }
+}
+
+/*
+ * Compiles the expression v. Without forms a form it calls at the top is
+ * compiled as an ordinary call, which is how LVM_FORM falls back.
+ */
+static lcode* lcode_compile(lval* v, int forms) {
+    lcode* c = calloc(1, sizeof(lcode));
+    c->refs = 1;
+    c->cell = v->cell;
+    c->count = v->count;
+    c->stack = 1;
+
+    int form;
+    if (v->count == 1) {
+        lcode_expr(c, v->cell[0], 0, 1);
+    } else if (forms && (form = lcode_form_of(v))) {
+        lcode_form(c, v, form, 0, 1, 1);
+    } else {
+        lcode_call(c, v, 0, 1);
+    }
+    c->caches = calloc(c->const_count, sizeof(lcache));
+    return c;
+}
+
+/*
+ * Returns a reference to the code of the expression v, compiling it if
+ * the buffer has none for this view.
+ */
+static lcode* lcode_get(lval* v) {
+    if (!v->count) {
+        lcode_nil.refs++;
+        return &lcode_nil;
+    }
+
+    lcode* c = v->buf->code;
+    if (!c || c->cell != v->cell || c->count != v->count) {
+        lcode_drop(c);
+        c = lcode_compile(v, 1);
+        v->buf->code = c;
+    }
+    c->refs++;
+    return c;
+}
+
+void lvm_set_max_depth(int depth) {
+    lvm.max = depth > 0 ? depth : LVM_MAX_DEPTH;
+}
+
+static lval* lvm_depth_err(void) {
+    return lval_err("Maximum evaluation depth of %i exceeded.", lvm.max);
+}
+
+static void lvm_push(lval* x) {
+    lvm.stack[lvm.sp++] = x;
+}
+
+static void lvm_reserve(int n) {
+    if (lvm.sp + n > lvm.cap) {
+        lvm.cap = (lvm.sp + n) * 2;
+        lvm.stack = realloc(lvm.stack, sizeof(lval*) * lvm.cap);
+    }
+}
+
+/*
+ * Drops what a frame that is not going to run would have taken.
+ */
+static void lvm_drop(lval* code, lcode* c, lval* f, lenv* act) {
+    lcode_drop(c);
+    lval_del(code);
+    if (act) {
+        lenv_del(act);
+    }
+    if (f) {
+        lval_del(f);
+    }
+}
+
+/*
+ * Pushes a frame running the code c of code in e, taking both and, for a
+ * lambda body or a scope, the activation act and the lambda f, if any.
+ * Everything is dropped and 0 returned when the maximum depth is reached.
+ */
+static int lvm_enter_code(lenv* e, lval* code, lcode* c, lval* f, lenv* act) {
+    if (lvm.fp >= lvm.max) {
+        lvm_drop(code, c, f, act);
+        return 0;
+    }
+
+    if (lvm.fp == lvm.frame_cap) {
+        lvm.frame_cap = lvm.frame_cap ? lvm.frame_cap * 2 : 64;
+        lvm.frames = realloc(lvm.frames, sizeof(lvm_frame) * lvm.frame_cap);
+    }
+
+    lvm_frame* fr = &lvm.frames[lvm.fp++];
+    fr->c = c;
+    fr->pc = 0;
+    fr->e = e;
+    fr->code = code;
+    fr->f = f;
+    fr->act = act;
+    fr->held = NULL;
+    fr->held_count = 0;
+    fr->memo = NULL;
+    fr->memo_key = NULL;
+    fr->resume = NULL;
+    fr->asked = 0;
+    lvm_reserve(fr->c->stack);
+    return 1;
+}
+
+static int lvm_enter(lenv* e, lval* code, lval* f, lenv* act) {
+    return lvm_enter_code(e, code, lcode_get(code), f, act);
+}
+
+/*
+ * Runs the code c of code in e in place of what fr was running, keeping
+ * its activation.
+ */
+static void lvm_replace_code(lvm_frame* fr, lenv* e, lval* code, lcode* c) {
+    lcode_drop(fr->c);
+    lval_del(fr->code);
+    fr->c = c;
+    fr->pc = 0;
+    fr->e = e;
+    fr->code = code;
+    fr->resume = NULL;
+    fr->asked = 0;
+    lvm_reserve(fr->c->stack);
+}
+
+static void lvm_replace(lvm_frame* fr, lenv* e, lval* code) {
+    lvm_replace_code(fr, e, code, lcode_get(code));
+}
+
+/*
+ * Keeps the activation of fr alive until the frame returns, as the
+ * frame is about to run code below it in another one.
+ */
+static void lvm_hold(lvm_frame* fr) {
+    if (fr->act) {
+        fr->held = realloc(fr->held, sizeof(lenv*) * (fr->held_count + 1));
+        fr->held[fr->held_count++] = fr->act;
+    }
+    if (fr->f) {
+        lval_del(fr->f);
+    }
+    fr->f = NULL;
+    fr->act = NULL;
+}
+
+static void lvm_leave(void) {
+    lvm_frame* fr = &lvm.frames[--lvm.fp];
+    lcode_drop(fr->c);
+    lval_del(fr->code);
+    if (fr->act) {
+        lenv_del(fr->act);
+    }
+    if (fr->f) {
+        lval_del(fr->f);
+    }
+    while (fr->held_count) {
+        lenv_del(fr->held[--fr->held_count]);
+    }
+    free(fr->held);
+    if (fr->memo) {
+        if (fr->memo_key) {
+            lval_del(fr->memo_key);
+        }
+        lmemo_drop(fr->memo);
+    }
+}
+
+static lval* lval_bind(lenv* act, lval* f, lval* a, int* used);
+static int lval_binds_all(lval* f, int n);
+static lenv* lval_activate(lenv* e, lval* f, lval* a, lval** r);
+
+/*
+ * Moves n values off the stack into an S-expression.
+ */
+static lval* lvm_args(lval** x, int n) {
+    lval* a = lval_sexpr();
+    lval_reserve(a, 0, n);
+    memcpy(a->cell, x, sizeof(lval*) * n);
+    a->count = n;
+    a->buf->hi += n;
+    return a;
+}
+
+/*
+ * Evaluates code in e as the value of the current step, in place of the
+ * frame when the step is in tail position and otherwise in a frame of
+ * its own. A scope act is given to the frame running the code.
+ */
+static void lvm_jump(lenv* e, lval* code, lenv* act, int tail) {
+    lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+    if (tail && (act || e == fr->e)) {
+        if (act) {
+            lvm_hold(fr);
+            fr->act = act;
         }
+        lvm_replace(fr, e, code);
+    } else if (!lvm_enter(e, code, NULL, act)) {
+        lvm_push(lvm_depth_err());
     }
-    putchar(close);
 }
 
-char* lval_expr_to_string(lenv* e, lval* v, char open, char close) {
-    char* buffer = malloc(2048);
-    if (!buffer) return NULL;
-    buffer[0] = '\0';
+/*
+ * Resumes fn on the state s, taken, in a frame of its own, or in place of
+ * the current frame when in tail position.
+ */
+static void lvm_enter_resume(lenv* e, lresume fn, lval* s, int tail) {
+    lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+    lcode_resume.refs++;
+    if (tail && e == fr->e) {
+        lvm_replace_code(fr, e, s, &lcode_resume);
+        fr->resume = fn;
+    } else if (lvm_enter_code(e, s, &lcode_resume, NULL, NULL)) {
+        lvm.frames[lvm.fp - 1].resume = fn;
+    } else {
+        lvm_push(lvm_depth_err());
+    }
+}
 
-    char temp[2] = {open, '\0'};
-    strcat(buffer, temp);
+/*
+ * Goes on with what a builtin handed back as ljump_mark: code to evaluate
+ * as its value, or a function to resume.
+ */
+static void lvm_take(int tail) {
+    lresume fn = ljump.resume;
+    ljump.resume = NULL;
+    if (fn) {
+        lvm_enter_resume(ljump.e, fn, ljump.v, tail);
+    } else {
+        lvm_jump(ljump.e, ljump.v, ljump.act, tail);
+    }
+}
 
-    for (int i = 0; i < v->count; i++) {
-        char* elem_str = lval_string(e, v->cell[i]);
-        if (!elem_str) continue;
+static lval* lval_call_builtin(lenv* e, lval* f, lval* a);
 
-        strcat(buffer, elem_str);
-        free(elem_str);
+/*
+ * Calls the memoised function f, taken, with the n values x, unless the
+ * cache has the result. A lambda runs in a frame of its own, which
+ * stores the result as it returns.
+ */
+static void lvm_memo_call(lenv* e, lval* f, lval** x, int n) {
+    lmemo* m = f->memo;
+    lval* r = lmemo_get(m, x, n);
+    if (r) {
+        for (int i = 0; i < n; i++) {
+            lval_del(x[i]);
+        }
+        lval_del(f);
+        lvm_push(r);
+        return;
+    }
 
-        if (i != (v->count - 1)) {
-            strcat(buffer, " ");
+    lval* a = lvm_args(x, n);
+    lval* key = lmemo_key(a);
+    if (m->f->data.builtin) {
+        ljump.ok = 1;
+        r = lval_call_builtin(e, m->f, a);
+        ljump.ok = 0;
+        if (r != &ljump_mark) {
+            lmemo_put(m, key, r);
+            lvm_push(r);
+        } else {
+            /* What the builtin handed back stores the result as it returns. */
+            int fp = lvm.fp;
+            lvm_take(0);
+            if (lvm.fp > fp) {
+                lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+                fr->memo = m;
+                fr->memo_key = key;
+                m->refs++;
+            } else {
+                lval_del(key);
+            }
         }
+        lval_del(f);
+        return;
     }
 
-    temp[0] = close;
-    strcat(buffer, temp);
+    lenv* act = lval_activate(e, m->f, a, &r);
+    if (!act) {
+        lval_del(key);
+        lval_del(f);
+        lvm_push(r);
+        return;
+    }
 
-    return buffer;
+    if (lvm_enter(act, lval_copy(m->f->body), lval_copy(m->f), act)) {
+        lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+        fr->memo = m;
+        fr->memo_key = key;
+        m->refs++;
+    } else {
+        lval_del(key);
+        lvm_push(lvm_depth_err());
+    }
+    lval_del(f);
 }
 
-void lval_print(lenv* e, lval* v) {
-    char* str = lval_string(e, v);
-    printf("%s", str);
-    free(str);
-}
+/*
+ * The S-expression step: the n values on top of the stack are replaced
+ * by the result of evaluating an S-expression holding them, or by the
+ * frame that computes it.
+ */
+static void lvm_call(int n, int tail) {
+    lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+    lenv* e = fr->e;
+    lval** x = &lvm.stack[lvm.sp - n];
+    lvm.sp -= n;
 
-char* lval_string(lenv* e, lval* v) {
-    char* buffer = malloc(2048);
-    if (!buffer) return NULL;
-    buffer[0] = '\0';
-    char temp[2048];
+    /* A frame with a result to cache has to return to store it. */
+    if (fr->memo_key) {
+        tail = 0;
+    }
 
-    switch (v->type) {
-        case LVAL_NUM:
-            snprintf(temp, sizeof(temp), "%lli", v->data.num);
-            strcat(buffer, temp);
-            break;
-        case LVAL_FLT:
-            snprintf(temp, sizeof(temp), "%.15g", v->data.flt);
-            strcat(buffer, temp);
-            break;
-        case LVAL_ERR:
-            snprintf(temp, sizeof(temp), "Error: %s", v->data.err);
-            strcat(buffer, temp);
-            break;
-        case LVAL_SYM:
-            strcat(buffer, v->data.sym);
-            break;
-        case LVAL_STR: 
-            snprintf(temp, sizeof(temp), "\"%s\"", v->data.str);
-            strcat(buffer, temp);
-            break;
-        case LVAL_FUN:
-            if (v->data.builtin) {
-                lval* x = lenv_fetch_symbol(e, v);
-                snprintf(temp, sizeof(temp), "<%s>", x->data.sym);
-                strcat(buffer, temp);
-            } else {
-                strcat(buffer, "(\\ ");
-                char* formals_str = lval_string(e, v->formals);
-                strcat(buffer, formals_str);
-                free(formals_str);
-                strcat(buffer, " ");
-                char* body_str = lval_string(e, v->body);
-                strcat(buffer, body_str);
-                free(body_str);
-                strcat(buffer, ")");
+    for (int i = 0; i < n; i++) {
+        if (x[i]->type == LVAL_ERR) {
+            lval* err = x[i];
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    lval_del(x[j]);
+                }
             }
-            break;
-        case LVAL_SEXPR:
-            char* sexpr = lval_expr_to_string(e, v, '(', ')');
-            strcat(buffer, sexpr);
-            free(sexpr);
-            break;
-        case LVAL_QEXPR:
-            char* qexpr = lval_expr_to_string(e, v, '{', '}');
-            strcat(buffer, qexpr);
-            free(qexpr);
-            break;
+            lvm_push(err);
+            return;
+        }
     }
 
-    return buffer;
-}
+    if (n == 0) {
+        lvm_push(lval_sexpr());
+        return;
+    }
+    if (n == 1) {
+        lvm_push(x[0]);
+        return;
+    }
 
-void lval_println(lenv* e, lval* v) {
-    lval_print(e, v);
-    putchar('\n');
-}
+    lval* f = x[0];
+    if (f->type != LVAL_FUN) {
+        lval* err = lval_err(
+            "S-Expression starts with incorrect type. "
+            "Got %s, Expected %s.",
+            ltype_name(f->type), ltype_name(LVAL_FUN)
+        );
+        for (int i = 0; i < n; i++) {
+            lval_del(x[i]);
+        }
+        lvm_push(err);
+        return;
+    }
 
-// LENV
+    if (f->data.builtin && f->memo) {
+        lvm_memo_call(e, f, x + 1, n - 1);
+        return;
+    }
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
-}
+    if (f->data.builtin) {
+        lval* r;
+        if (f->argv) {
+            /* Keep the arguments below anything the builtin runs. */
+            int base = lvm.sp;
+            lvm.sp += n;
+            ljump.ok = 1;
+            r = f->data.builtin_argv(e, n - 1, &lvm.stack[base + 1]);
+            ljump.ok = 0;
+            lvm.sp = base;
+            for (int i = 1; i < n; i++) {
+                if (lvm.stack[base + i]) {
+                    lval_del(lvm.stack[base + i]);
+                }
+            }
+        } else {
+            ljump.ok = 1;
+            r = f->data.builtin(e, lvm_args(x + 1, n - 1));
+            ljump.ok = 0;
+        }
+        lval_del(f);
 
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        if (r != &ljump_mark) {
+            lvm_push(r);
+            return;
+        }
+
+        /* The builtin may have run the machine itself and moved frames. */
+        lvm_take(tail);
+        return;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
-}
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->data.sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
+    lval* a = lvm_args(x + 1, n - 1);
+    if (tail && f == fr->f && e == fr->act &&
+        lval_binds_all(f, a->count)) {
+        int used;
+        lval_bind(e, f, a, &used);
+        lvm_replace(fr, e, lval_copy(f->body));
+        lval_del(f);
+        return;
     }
 
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } 
+    lval* r;
+    lenv* act = lval_activate(e, f, a, &r);
+    if (!act) {
+        lval_del(f);
+        lvm_push(r);
+        return;
+    }
 
-    return lval_err("unbound symbol '%s'", k->data.sym);
+    if (tail) {
+        lvm_hold(fr);
+        fr->f = f;
+        fr->act = act;
+        lvm_replace(fr, act, lval_copy(f->body));
+    } else if (!lvm_enter(act, lval_copy(f->body), f, act)) {
+        lvm_push(lvm_depth_err());
+    }
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+/*
+ * Looks up the symbol constant i of c from e. With dynamic scope a name
+ * is found in the nearest frame on the call chain that binds it, so
+ * finding a global takes a walk up the whole chain. A name nothing binds
+ * outside the root environment can only be found there, though, and its
+ * binding is kept in the inline cache of the load until the root
+ * environment changes.
+ */
+static lval* lvm_load(lenv* e, lcode* c, int i) {
+    lval* k = c->consts[i];
+    if (k->slot >= 0 || LSYM_NAME(k->data.sym)->bound || lgc.root_count != 1) {
+        return lenv_get(e, k);
     }
-    return n;
-}
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-    while (e->par) {
-        e = e->par;
+    lcache* ic = &c->caches[i];
+    if (ic->version != lenv_version) {
+        lenv* top = e;
+        while (top->par) {
+            top = top->par;
+        }
+
+        int j = (top->gc & LGC_ROOT) ? lenv_find(top, k->data.sym) : -1;
+        if (j == -1 || !top->vals[j]) {
+            return lenv_get(e, k);
+        }
+        ic->version = lenv_version;
+        ic->val = top->vals[j];
     }
-    lenv_put(e, k, v);
+    return lval_copy(ic->val);
 }
 
-lval* lenv_fetch_symbol(lenv* e, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (e->vals[i]->data.builtin == v->data.builtin) {
-            return lval_sym(e->syms[i]);
-        }
+/*
+ * True when symbol constant i of c is bound to the given form in e.
+ */
+static int lvm_is_form(lenv* e, lcode* c, int i, int form) {
+    lval* f = lvm_load(e, c, i);
+    int r = f->type == LVAL_FUN && f->data.builtin && f->form == form;
+    lval_del(f);
+    return r;
+}
+
+/*
+ * Pops the truth value of a condition, or pushes an error and returns
+ * -1 if it is not a number.
+ */
+static int lvm_truth(char* func) {
+    lval* x = lvm.stack[--lvm.sp];
+    if (x->type == LVAL_NUM) {
+        int r = x->data.num != 0;
+        lval_del(x);
+        return r;
     }
 
-    if (e->par) {
-        return lenv_fetch_symbol(e->par, v);
-    } 
+    if (x->type != LVAL_ERR) {
+        lval* err = func
+            ? lval_err("Function '%s' passed incorrect type for argument 0. "
+                "Got %s, Expected %s.", func, ltype_name(x->type),
+                ltype_name(LVAL_NUM))
+            : lval_err("Cannot operate on non-number!");
+        lval_del(x);
+        x = err;
+    }
+    lvm_push(x);
+    return -1;
+}
 
-    return lval_err("functions symbol not found");
+/*
+ * Binds the symbols of constant k to the n values on top of the stack,
+ * as 'def' or '=' do.
+ */
+static void lvm_define(lvm_frame* fr, int k, int n, int put) {
+    lval* syms = fr->c->consts[k];
+    lval** x = &lvm.stack[lvm.sp - n];
+    lvm.sp -= n;
+
+    lval* r = NULL;
+    for (int i = 0; i < n && !r; i++) {
+        if (x[i]->type == LVAL_ERR) {
+            r = lval_copy(x[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (!r) {
+            if (put) {
+                lenv_put(fr->e, syms->cell[i], x[i]);
+            } else {
+                lenv_def(fr->e, syms->cell[i], x[i]);
+            }
+        }
+        lval_del(x[i]);
+    }
+    lvm_push(r ? r : lval_sexpr());
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->data.sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+/*
+ * Evaluates what a resumed function asked for, for its frame to be
+ * resumed with the value.
+ */
+static void lvm_ask(void) {
+    lval* v = ljump.v;
+    if (ljump.call) {
+        int n = ljump.call;
+        ljump.call = 0;
+        lvm_call(n, 0);
+    } else if (v->type == LVAL_SEXPR) {
+        if (!lvm_enter(ljump.e, v, NULL, NULL)) {
+            lvm_push(lvm_depth_err());
         }
+    } else {
+        lvm_push(lval_eval(ljump.e, v));
     }
+}
 
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+/*
+ * Runs the frames on top of floor until they have all returned.
+ */
+static lval* lvm_loop(int floor) {
+    while (1) {
+        lvm_frame* fr = &lvm.frames[lvm.fp - 1];
+        lcode* c = fr->c;
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->data.sym) + 1);
-    strcpy(e->syms[e->count - 1], k->data.sym);
-}
+        if (fr->pc == c->op_count) {
+            lval* x = lvm.stack[--lvm.sp];
+            if (fr->memo_key) {
+                lmemo_put(fr->memo, fr->memo_key, x);
+                fr->memo_key = NULL;
+            }
+            lvm_leave();
+            if (lvm.fp == floor) {
+                return x;
+            }
+            lvm_push(x);
+            continue;
+        }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_builtin(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+        int* op = &c->ops[fr->pc];
+        switch (op[0]) {
+            case LVM_CONST:
+                fr->pc += 2;
+                lvm_push(lval_copy(c->consts[op[1]]));
+                break;
+            case LVM_LOAD:
+                fr->pc += 2;
+                lvm_push(lvm_load(fr->e, c, op[1]));
+                break;
+            case LVM_CALL:
+            case LVM_TAIL:
+                fr->pc += 2;
+                lvm_call(op[1], op[0] == LVM_TAIL);
+                break;
+            case LVM_JUMP:
+                fr->pc = op[1];
+                break;
+            case LVM_FORM:
+                fr->pc += 5;
+                if (!lvm_is_form(fr->e, c, op[1], op[2])) {
+                    lval* node = op[3] < 0 ? fr->code : c->consts[op[3]];
+                    fr->pc = op[4];
+                    if (!lvm_enter_code(fr->e, lval_copy(node),
+                        lcode_compile(node, 0), NULL, NULL)) {
+                        lvm_push(lvm_depth_err());
+                    }
+                }
+                break;
+            case LVM_IF:
+                switch (lvm_truth("if")) {
+                    case 1: fr->pc += 3; break;
+                    case 0: fr->pc = op[1]; break;
+                    default: fr->pc = op[2]; break;
+                }
+                break;
+            case LVM_AND:
+            case LVM_OR: {
+                int r = lvm_truth(NULL);
+                if (r == -1 || r == (op[0] == LVM_OR)) {
+                    if (r != -1) {
+                        lvm_push(lval_num(r));
+                    }
+                    fr->pc = op[1];
+                } else {
+                    fr->pc += 2;
+                }
+                break;
+            }
+            case LVM_TRUTH: {
+                fr->pc += 1;
+                int r = lvm_truth(NULL);
+                if (r != -1) {
+                    lvm_push(lval_num(r));
+                }
+                break;
+            }
+            case LVM_DROP: {
+                lval* x = lvm.stack[lvm.sp - 1];
+                if (x->type == LVAL_ERR) {
+                    fr->pc = op[1];
+                } else {
+                    fr->pc += 2;
+                    lval_del(x);
+                    lvm.sp--;
+                }
+                break;
+            }
+            case LVM_DEF:
+            case LVM_PUT:
+                fr->pc += 3;
+                lvm_define(fr, op[1], op[2], op[0] == LVM_PUT);
+                break;
+            case LVM_LAMBDA: {
+                fr->pc += 2;
+                lcache* built = &c->caches[op[1]];
+                if (!built->val) {
+                    built->val = lval_lambda(lval_copy(c->consts[op[1]]),
+                        lval_copy(c->consts[op[1] + 1]));
+                }
+                lvm_push(lval_copy(built->val));
+                break;
+            }
+            case LVM_LET: {
+                fr->pc += 3;
+                lenv* s = lenv_new();
+                s->par = fr->e;
+                lvm_jump(s, lval_copy(c->consts[op[1]]), s, op[2] && !fr->memo_key);
+                break;
+            }
+            case LVM_EVAL:
+                fr->pc += 2;
+                if (!lvm_enter(fr->e, lval_copy(c->consts[op[1]]), NULL, NULL)) {
+                    lvm_push(lvm_depth_err());
+                }
+                break;
+            case LVM_RESUME: {
+                lval* x = fr->asked ? lvm.stack[--lvm.sp] : NULL;
+                ljump.ok = 1;
+                lval* r = fr->resume(fr->e, fr->code, fr->asked, x);
+                ljump.ok = 0;
+                fr = &lvm.frames[lvm.fp - 1];
+                if (r != &ljump_mark) {
+                    fr->pc = 1;
+                    lvm_push(r);
+                } else if (ljump.back) {
+                    ljump.back = 0;
+                    fr->asked++;
+                    lvm_ask();
+                } else {
+                    fr->pc = 1;
+                    lvm_take(1);
+                }
+                break;
+            }
+        }
+    }
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+/*
+ * Runs a frame as lvm_enter_code() pushes it, resuming fn if there is
+ * one, to its value.
+ */
+static lval* lvm_run_code(lenv* e, lval* code, lcode* c, lval* f, lenv* act,
+    lresume fn) {
+    if (!lvm.max) {
+        char* depth = getenv("LZP_STACK_DEPTH");
+        lvm_set_max_depth(depth ? atoi(depth) : 0);
     }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+
+    int floor = lvm.fp;
+    if (lvm.runs == LVM_MAX_RUNS) {
+        lvm_drop(code, c, f, act);
+        return lval_err("Maximum evaluation depth of %i nested builtin calls "
+            "exceeded.", LVM_MAX_RUNS);
     }
-    return v;
+    if (!lvm_enter_code(e, code, c, f, act)) {
+        return lvm_depth_err();
+    }
+    lvm.frames[lvm.fp - 1].resume = fn;
+
+    lvm.runs++;
+    lgc.depth++;
+    lval* x = lvm_loop(floor);
+    lgc.depth--;
+    lvm.runs--;
+    return x;
+}
+
+static lval* lvm_run(lenv* e, lval* code, lval* f, lenv* act) {
+    return lvm_run_code(e, code, lcode_get(code), f, act, NULL);
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
+    ljump.ok = 0;
+    return lvm_run(e, v, NULL, NULL);
+}
 
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
-        }
+/*
+ * Evaluates the Q-expression v as code, as 'eval' does.
+ */
+lval* lval_eval_qexpr(lenv* e, lval* v) {
+    if (ljump.ok) {
+        ljump.ok = 0;
+        ljump.v = v;
+        ljump.e = e;
+        ljump.act = NULL;
+        return &ljump_mark;
     }
+    return lvm_run(e, v, NULL, NULL);
+}
 
-    if (v->count == 0) {
-        return v;
+/*
+ * Evaluates the Q-expression v in a new scope below e, as 'let' does.
+ */
+lval* lval_eval_scope(lenv* e, lval* v) {
+    lenv* s = lenv_new();
+    s->par = e;
+    if (ljump.ok) {
+        ljump.ok = 0;
+        ljump.v = v;
+        ljump.e = s;
+        ljump.act = s;
+        return &ljump_mark;
     }
+    return lvm_run(s, v, NULL, s);
+}
 
-    if (v->count == 1) {
-        return lval_take(v, 0);
+/*
+ * Runs fn as the rest of a builtin, resumed on the state s, taken, by a
+ * frame of the machine. Each time fn either returns the value of the
+ * builtin or asks for a value with lval_resume_call() or
+ * lval_resume_eval(), and is resumed with it as x, which it takes, and
+ * the number of values it has been given in k. A function called that
+ * way runs in a frame above, instead of nesting on the C stack below the
+ * builtin. The state is fn's to change as it goes.
+ */
+lval* lval_resume(lenv* e, lresume fn, lval* s) {
+    if (ljump.ok) {
+        ljump.ok = 0;
+        ljump.v = s;
+        ljump.e = e;
+        ljump.act = NULL;
+        ljump.resume = fn;
+        return &ljump_mark;
     }
+    lcode_resume.refs++;
+    return lvm_run_code(e, s, &lcode_resume, NULL, NULL, fn);
+}
 
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-            "S-Expression starts with incorrect type. "
-            "Got %s, Expected %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN)
-        );
-        lval_del(f); lval_del(v);
-        return err;
+/*
+ * Asks, as a resumed function returning this, for f called on the n
+ * values x, taking them all. n must be at least 1.
+ */
+lval* lval_resume_call(lval* f, int n, lval** x) {
+    lvm_reserve(n + 1);
+    lvm_push(f);
+    for (int i = 0; i < n; i++) {
+        lvm_push(x[i]);
     }
-
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    ljump.ok = 0;
+    ljump.back = 1;
+    ljump.call = n + 1;
+    return &ljump_mark;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->data.builtin) {
-        return f->data.builtin(e, a);
-    }
+/*
+ * Asks, as a resumed function returning this, for v evaluated in e, as
+ * lval_eval() would. Takes v.
+ */
+lval* lval_resume_eval(lenv* e, lval* v) {
+    ljump.ok = 0;
+    ljump.back = 1;
+    ljump.call = 0;
+    ljump.v = v;
+    ljump.e = e;
+    return &ljump_mark;
+}
 
+/*
+ * Binds the arguments a to the formals of the lambda f in act, consuming
+ * a. Returns an error, or NULL with the number of formals taken in used.
+ */
+static lval* lval_bind(lenv* act, lval* f, lval* a, int* used) {
+    lval* formals = f->formals;
     int given = a->count;
-    int total = f->formals->count;
+    int total = formals->count;
+    int i = 0;
 
     while (a->count) {
-        if (f->formals->count == 0) {
+        if (i == total) {
             lval_del(a);
             return lval_err(
                 "Function passed too many arguments. "
@@ -597,118 +4477,182 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
             );
         }
 
-        lval* sym = lval_pop(f->formals, 0);
+        lval* sym = formals->cell[i++];
 
-        if (strcmp(sym->data.sym, "&") == 0) {
-            if (f->formals->count != 1) {
+        if (sym->data.sym == lsym_amp) {
+            if (total - i != 1) {
                 lval_del(a);
                 return lval_err("Function format invalid. "
                     "Symbol '&' not followed by single symbol.");
             }
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
+            a->type = LVAL_QEXPR;
+            lenv_put(act, formals->cell[i++], a);
+            lval_del(a);
+            *used = i;
+            return NULL;
         }
 
         lval* val = lval_pop(a, 0);
-
-        lenv_put(f->env, sym, val);
-
-        lval_del(sym);
+        lenv_put(act, sym, val);
         lval_del(val);
     }
 
     lval_del(a);
 
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->data.sym, "&") == 0) {
-    
-        if (f->formals->count != 2) {
-        return lval_err("Function format invalid. "
-            "Symbol '&' not followed by single symbol.");
-        }
-        
-        lval_del(lval_pop(f->formals, 0));
-        
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-        
-        lenv_put(f->env, sym, val);
-        lval_del(sym); lval_del(val);
-    }
+    if (i < total && formals->cell[i]->data.sym == lsym_amp) {
+        if (total - i != 2) {
+            return lval_err("Function format invalid. "
+                "Symbol '&' not followed by single symbol.");
+        }
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        lval* val = lval_qexpr();
+        lenv_put(act, formals->cell[i + 1], val);
+        lval_del(val);
+        i += 2;
     }
 
-    return lval_copy(f);
+    *used = i;
+    return NULL;
 }
 
-// buildin
-
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+/*
+ * True when calling f with n arguments binds every formal, with no '&'.
+ */
+static int lval_binds_all(lval* f, int n) {
+    if (f->formals->count != n) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (f->formals->cell[i]->data.sym == lsym_amp) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
-}
+/*
+ * Makes the activation for calling the lambda f on the arguments a from
+ * the caller's environment e: a copy of the frame template of f with the
+ * arguments bound. When the call does not go ahead NULL is returned and
+ * the result left in r, either an error or, when formals are left
+ * unbound, a partial application. That is a new lambda with the same
+ * body whose template holds just the arguments supplied so far.
+ */
+static lenv* lval_activate(lenv* e, lval* f, lval* a, lval** r) {
+    lenv* act = lenv_copy(f->env);
+    int used;
 
-lval* builtin_read(lenv* e, lval* a) {
-    LASSERT_NUM("read", a, 1);
-    LASSERT_TYPE("read", a, 0, LVAL_STR);
+    *r = lval_bind(act, f, a, &used);
+    if (*r) {
+        lenv_del(act);
+        return NULL;
+    }
 
-    mpc_result_t r;
-    
-    if (mpc_parse("<string>", a->cell[0]->data.str, Lzp, &r)) {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    if (used < f->formals->count) {
+        lval* p = lval_alloc();
+        p->type = LVAL_FUN;
+        p->refs = 1;
+        p->data.builtin = NULL;
+        p->env = act;
+        p->formals = lval_slice(lval_copy(f->formals), used,
+            f->formals->count - used);
+        p->body = lval_copy(f->body);
+        *r = p;
+        return NULL;
+    }
 
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
+    act->par = e;
+    return act;
+}
 
-            if (x->type == LVAL_ERR) {
-                lval_println(e, x);
+/*
+ * Calls the builtin f on the arguments a, taken. Called by the machine, a
+ * builtin may hand back ljump_mark.
+ */
+static lval* lval_call_builtin(lenv* e, lval* f, lval* a) {
+    if (f->memo) {
+        lval* r = lmemo_get(f->memo, a->cell, a->count);
+        if (r) {
+            lval_del(a);
+            return r;
+        }
+        lval* key = lmemo_key(a);
+        r = lval_call(e, f->memo->f, a);
+        lmemo_put(f->memo, key, r);
+        return r;
+    }
+    if (f->argv) {
+        a = lval_unshare(a);
+        lval* r = f->data.builtin_argv(e, a->count, a->cell);
+        for (int i = 0; i < a->count; i++) {
+            if (a->cell[i]) {
+                lval_del(a->cell[i]);
             }
-            lval_del(x);
         }
-
-        lval_del(expr);
+        if (a->buf) {
+            a->buf->hi = a->buf->lo;
+        }
+        a->count = 0;
         lval_del(a);
+        return r;
+    }
+    return f->data.builtin(e, a);
+}
 
-        return lval_sexpr();
-    } else {
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    ljump.ok = 0;
+    if (f->data.builtin) {
+        return lval_call_builtin(e, f, a);
+    }
 
-        lval* err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    lval* r;
+    lenv* act = lval_activate(e, f, a, &r);
+    if (!act) {
+        return r;
+    }
+    return lvm_run(act, lval_copy(f->body), lval_copy(f), act);
+}
 
-        return err;
+// buildin
+
+lval* builtin_eval(lenv* e, int argc, lval** argv) {
+    LASSERT_ARGV_NUM("eval", argc, 1);
+    LASSERT_ARGV_TYPE("eval", argv, 0, LVAL_QEXPR);
+
+    return lval_eval_qexpr(e, lval_take_arg(argv, 0));
+}
+
+lval* builtin_list(lenv* e, int argc, lval** argv) {
+    (void)e;
+    lval* x = lval_qexpr();
+    if (argc) {
+        lval_reserve(x, 0, argc);
     }
+    for (int i = 0; i < argc; i++) {
+        lval_add(x, lval_take_arg(argv, i));
+    }
+    return x;
 }
 
-void read_xxd(lenv* e, const unsigned char* xxd_arr, unsigned int xxd_arr_len) {
-    char* string_p = malloc(xxd_arr_len + 1);
-    memcpy(string_p, xxd_arr, xxd_arr_len);
-    string_p[xxd_arr_len] = '\0';
+lval* builtin_read(lenv* e, lval* a) {
+    LASSERT_NUM("read", a, 1);
+    LASSERT_TYPE("read", a, 0, LVAL_STR);
 
+    lgc_push(a);
+    lval* x = lval_load(e, "<string>", a->cell[0]->data.str, a->cell[0]->len);
+    lgc_pop(1);
+
+    lval_del(a);
+    return x;
+}
 
-    lval* l = lval_sexpr();
-    lval_add(l, lval_str(string_p));
-    free(string_p);
-    builtin_read(e, l);
+void read_xxd(lenv* e, const unsigned char* xxd_arr, unsigned int xxd_arr_len) {
+    lval* x = lval_load(e, "<string>", (char*)xxd_arr, xxd_arr_len);
+    if (x->type == LVAL_ERR) {
+        lval_println(e, x);
+    }
+    lval_del(x);
 }
 
 void init_parser() {
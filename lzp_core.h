@@ -24,12 +24,57 @@
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
+/* The same checks for builtins taking an argument vector. */
+#define LASSERT_ARGV(cond, fmt, ...) \
+  if (!(cond)) { \
+    return lval_err(fmt, ##__VA_ARGS__); \
+  }
+
+#define LASSERT_ARGV_TYPE(func, argv, index, expect) \
+  LASSERT_ARGV(argv[index]->type == expect, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(argv[index]->type), ltype_name(expect))
+
+#define LASSERT_ARGV_NUM(func, argc, num) \
+  LASSERT_ARGV(argc == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+    func, argc, num)
+
+#define LASSERT_ARGV_NOT_EMPTY(func, argv, index) \
+  LASSERT_ARGV(argv[index]->count != 0, \
+    "Function '%s' passed {} for argument %i.", func, index);
+
+#define LASSERT_ARGV_LIST(func, argv, index) \
+  LASSERT_ARGV(argv[index]->type == LVAL_QEXPR || argv[index]->type == LVAL_STR, \
+    "Function '%s' passed incorrect type. " \
+    "Got %s, Expected Q-Expression or String.", func, ltype_name(argv[index]->type))
+
+#define LASSERT_ARGV_INDEX(func, n, len, max) \
+  LASSERT_ARGV(n >= 0 && n <= max, \
+    "Function '%s' passed index %lli out of range. Length is %i.", func, n, len)
+
 struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
+
+/*
+ * Builtins can also take their arguments as a vector. The storage belongs
+ * to the caller and so do the arguments: a builtin only borrows them,
+ * unless it takes one with lval_take_arg(), and the caller deletes what
+ * is left. The vector may live on the evaluation stack, so it is only
+ * valid until the builtin evaluates anything.
+ */
+typedef lval*(*lbuiltin_argv)(lenv*, int, lval**);
+
+/*
+ * The rest of a builtin that calls functions, resumed with its state, the
+ * number of values it has asked for and the last of them, see
+ * lval_resume().
+ */
+typedef lval*(*lresume)(lenv*, lval*, int, lval*);
 typedef void (*lzp_plugin_init_fn)(lenv* env);
 
 extern mpc_parser_t* Number;
@@ -53,8 +98,31 @@ enum lval_type {
     LVAL_QEXPR
 };
 
+/*
+ * Builtins the evaluator compiles inline when it sees them called, so
+ * their arguments are evaluated lazily. A builtin registered as a form
+ * still works when it is called any other way.
+ */
+enum lform {
+    LFORM_NONE,
+    LFORM_IF,
+    LFORM_DEF,
+    LFORM_PUT,
+    LFORM_LAMBDA,
+    LFORM_DO,
+    LFORM_LET,
+    LFORM_AND,
+    LFORM_OR,
+    LFORM_COUNT
+};
+
 struct lval {
     enum lval_type type;
+    int refs;
+    unsigned char gc;
+    unsigned char argv;
+    unsigned char form;
+    unsigned int mark;
     union {
         long long num;
         double flt;
@@ -62,42 +130,126 @@ struct lval {
         char* sym;
         char* str;
         lbuiltin builtin;
+        lbuiltin_argv builtin_argv;
     } data;
 
-    lenv* env;
-    lval* formals;
-    lval* body;
-
-    int count;
-    struct lval** cell;
+    union {
+        struct {
+            union {
+                lenv* env;
+                struct lmemo* memo;
+            };
+            lval* formals;
+            lval* body;
+        };
+        struct {
+            int count;
+            int slot;
+            struct lval** cell;
+            struct lcells* buf;
+        };
+        struct {
+            int len;
+            int size;
+            char chars[16];
+        };
+    };
 };
 
 struct lenv {
     lenv* par;
     int count;
+    int cap;
     char** syms;
     lval** vals;
+    int* index;
+    int index_cap;
+    unsigned char gc;
+    unsigned int mark;
 };
 
+typedef struct lgc_stats {
+    long long collections;
+    double pause_total;
+    double pause_max;
+    long long live_bytes;
+    long long peak_bytes;
+} lgc_stats;
+
+typedef struct lmemo_stats {
+    long long hits;
+    long long misses;
+    long long evictions;
+    int size;
+    int max;
+} lmemo_stats;
+
+/*
+ * Reads lzp source text one top-level expression at a time. The text is
+ * borrowed and need not be NUL terminated.
+ */
+typedef struct lreader {
+    char* name;
+    char* src;
+    char* cur;
+    char* end;
+    int failed;
+#ifdef LZP_MPC_READER
+    mpc_ast_t* ast;
+    int next;
+    lval* err;
+#endif
+} lreader;
+
 char* ltype_name(enum lval_type t);
 
+void* lpool_alloc(size_t size);
+void lpool_free(void* x, size_t size);
+void lpool_release(void);
+
+void lgc_add_root(lenv* e);
+void lgc_push(lval* v);
+void lgc_pop(int n);
+void lgc_collect(void);
+void lgc_maybe_collect(void);
+lgc_stats lgc_get_stats(void);
+
+void lvm_set_max_depth(int depth);
+
 lval* lval_num(long long x);
 lval* lval_flt(double x);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
+lval* lval_symn(char* s, int len);
 lval* lval_str(char* s);
+lval* lval_strn(char* s, int len);
 lval* lval_builtin(lbuiltin func);
+lval* lval_builtin_argv(lbuiltin_argv func);
 lval* lval_lambda(lval* formals, lval* body);
+lval* lval_memo(lval* f, int max);
+int lval_memo_stats(lval* f, lmemo_stats* s);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 void lval_del(lval* v);
 lval* lval_copy(lval* v);
+lval* lval_unshare(lval* v);
 lval* lval_add(lval* v, lval* x);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
+lval* lval_take_arg(lval** argv, int i);
+lval* lval_slice(lval* v, int start, int count);
 lval* lval_join(lval* x, lval* y);
+lval* lval_str_join(lval* x, lval* y);
 int lval_eq(lval* x, lval* y);
 lval* lval_read(mpc_ast_t* t);
+void lreader_init(lreader* r, char* name, char* src, long len);
+lval* lreader_next(lreader* r);
+lval* lval_read_src(char* name, char* src, long len);
+lval* lval_load(lenv* e, char* name, char* src, long len);
+lval* lval_load_file(lenv* e, char* path);
+lval* lenv_save_image(lenv* e, char* path);
+lval* lenv_load_image(lenv* e, const unsigned char* data, long len);
+lval* lenv_load_image_file(lenv* e, char* path);
 void lval_print(lenv* e, lval* v);
 void lval_println(lenv* e, lval* v);
 char* lval_expr_to_string(lenv* e, lval* v, char open, char close);
@@ -115,14 +267,21 @@ void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+void lenv_add_builtin_argv(lenv* e, char* name, lbuiltin_argv func);
+void lenv_add_form(lenv* e, char* name, lbuiltin_argv func, enum lform form);
 void lenv_add_builtins(lenv* e);
 lval* lenv_fetch_symbol(lenv* e, lval* v);
 
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_qexpr(lenv* e, lval* v);
+lval* lval_eval_scope(lenv* e, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_resume(lenv* e, lresume fn, lval* s);
+lval* lval_resume_call(lval* f, int n, lval** x);
+lval* lval_resume_eval(lenv* e, lval* v);
 
-lval* builtin_eval(lenv* e, lval* a);
-lval* builtin_list(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, int argc, lval** argv);
+lval* builtin_list(lenv* e, int argc, lval** argv);
 lval* builtin_read(lenv* e, lval* a);
 
 void read_xxd(lenv* e, const unsigned char* xxd_arr, unsigned int xxd_arr_len);
@@ -56,7 +56,6 @@ lval* builtin_time(lenv* e, lval* a) {
 }
 
 void lzp_plugin_init(lenv* env) {
-    init_parser();
     lenv_add_builtin(env, "time", builtin_time);
     lenv_add_builtin(env, "time-milli", builtin_time_milli);
 
@@ -0,0 +1,42 @@
+unsigned char prelude_img[] = {
+  0x4c, 0x5a, 0x50, 0x49, 0x01, 0x10, 0x05, 0x03, 0x6e, 0x69, 0x6c, 0x09,
+  0x00, 0x05, 0x04, 0x74, 0x72, 0x75, 0x65, 0x02, 0x02, 0x05, 0x05, 0x66,
+  0x61, 0x6c, 0x73, 0x65, 0x02, 0x00, 0x05, 0x03, 0x66, 0x75, 0x6e, 0x0b,
+  0x02, 0x05, 0x01, 0x66, 0x00, 0x05, 0x01, 0x62, 0x00, 0x09, 0x02, 0x01,
+  0x06, 0x01, 0x07, 0x09, 0x03, 0x05, 0x03, 0x64, 0x65, 0x66, 0x08, 0x02,
+  0x05, 0x04, 0x68, 0x65, 0x61, 0x64, 0x06, 0x00, 0x01, 0x06, 0x08, 0x03,
+  0x05, 0x01, 0x5c, 0x08, 0x02, 0x05, 0x04, 0x74, 0x61, 0x69, 0x6c, 0x01,
+  0x0d, 0x06, 0x01, 0x01, 0x07, 0x05, 0x06, 0x75, 0x6e, 0x70, 0x61, 0x63,
+  0x6b, 0x0b, 0x02, 0x01, 0x06, 0x00, 0x05, 0x01, 0x6c, 0x00, 0x09, 0x02,
+  0x01, 0x06, 0x01, 0x15, 0x09, 0x02, 0x05, 0x04, 0x65, 0x76, 0x61, 0x6c,
+  0x08, 0x03, 0x05, 0x04, 0x6a, 0x6f, 0x69, 0x6e, 0x08, 0x02, 0x05, 0x04,
+  0x6c, 0x69, 0x73, 0x74, 0x01, 0x0d, 0x06, 0x01, 0x01, 0x15, 0x05, 0x04,
+  0x70, 0x61, 0x63, 0x6b, 0x0b, 0x02, 0x01, 0x06, 0x00, 0x05, 0x02, 0x78,
+  0x73, 0x00, 0x09, 0x03, 0x01, 0x06, 0x05, 0x01, 0x26, 0x01, 0x20, 0x09,
+  0x02, 0x01, 0x0d, 0x06, 0x01, 0x01, 0x20, 0x05, 0x05, 0x63, 0x75, 0x72,
+  0x72, 0x79, 0x01, 0x14, 0x05, 0x07, 0x75, 0x6e, 0x63, 0x75, 0x72, 0x72,
+  0x79, 0x01, 0x1f, 0x05, 0x04, 0x62, 0x6f, 0x6f, 0x6c, 0x0b, 0x01, 0x05,
+  0x01, 0x78, 0x00, 0x09, 0x01, 0x01, 0x29, 0x09, 0x02, 0x05, 0x01, 0x21,
+  0x08, 0x02, 0x01, 0x2c, 0x06, 0x00, 0x01, 0x29, 0x05, 0x03, 0x6e, 0x6f,
+  0x74, 0x0b, 0x01, 0x01, 0x29, 0x00, 0x09, 0x01, 0x01, 0x29, 0x09, 0x02,
+  0x01, 0x2c, 0x01, 0x2e, 0x05, 0x02, 0x6f, 0x72, 0x0b, 0x02, 0x01, 0x29,
+  0x00, 0x05, 0x01, 0x79, 0x00, 0x09, 0x02, 0x01, 0x29, 0x01, 0x35, 0x09,
+  0x03, 0x05, 0x02, 0x7c, 0x7c, 0x01, 0x2e, 0x06, 0x01, 0x01, 0x35, 0x05,
+  0x03, 0x61, 0x6e, 0x64, 0x0b, 0x02, 0x01, 0x29, 0x00, 0x01, 0x35, 0x00,
+  0x09, 0x02, 0x01, 0x29, 0x01, 0x35, 0x09, 0x03, 0x05, 0x02, 0x26, 0x26,
+  0x01, 0x2e, 0x01, 0x39, 0x05, 0x03, 0x66, 0x73, 0x74, 0x0b, 0x01, 0x01,
+  0x15, 0x00, 0x09, 0x01, 0x01, 0x15, 0x09, 0x02, 0x01, 0x18, 0x08, 0x02,
+  0x01, 0x0c, 0x06, 0x00, 0x01, 0x15, 0x05, 0x03, 0x73, 0x6e, 0x64, 0x0b,
+  0x01, 0x01, 0x15, 0x00, 0x09, 0x01, 0x01, 0x15, 0x09, 0x02, 0x01, 0x18,
+  0x08, 0x02, 0x01, 0x0c, 0x08, 0x02, 0x01, 0x11, 0x01, 0x44, 0x05, 0x03,
+  0x74, 0x72, 0x64, 0x0b, 0x01, 0x01, 0x15, 0x00, 0x09, 0x01, 0x01, 0x15,
+  0x09, 0x02, 0x01, 0x18, 0x08, 0x02, 0x01, 0x0c, 0x08, 0x02, 0x01, 0x11,
+  0x08, 0x02, 0x01, 0x11, 0x01, 0x44, 0x05, 0x06, 0x61, 0x73, 0x73, 0x65,
+  0x72, 0x74, 0x0b, 0x02, 0x01, 0x29, 0x00, 0x05, 0x03, 0x65, 0x72, 0x72,
+  0x00, 0x09, 0x02, 0x01, 0x29, 0x01, 0x54, 0x09, 0x04, 0x05, 0x02, 0x69,
+  0x66, 0x08, 0x02, 0x01, 0x2c, 0x01, 0x2e, 0x09, 0x02, 0x05, 0x05, 0x65,
+  0x72, 0x72, 0x6f, 0x72, 0x08, 0x03, 0x01, 0x1a, 0x07, 0x12, 0x61, 0x73,
+  0x73, 0x65, 0x72, 0x74, 0x69, 0x6e, 0x67, 0x20, 0x66, 0x61, 0x69, 0x6c,
+  0x65, 0x64, 0x3a, 0x20, 0x06, 0x01, 0x01, 0x54, 0x09, 0x01, 0x01, 0x00
+};
+unsigned int prelude_img_len = 468;